@@ -0,0 +1,62 @@
+# Template.render / render_bytes against the same dialogue written in plain
+# Python. Python 3.5 has no f-strings, so the baselines use str.format and %.
+#
+# _phiori is built into phiori.dll, so run this from a ghost's python, e.g.
+# import it in phiori.py and call main(), or against template.c built as an
+# extension module. Output is checked to match before anything is timed.
+import random, sys, timeit
+import _phiori
+
+SOURCE = (r'\h\s[{face}]{Good morning|Morning|Hey there}, {user}.\w9 '
+          r"{It is {hour} o'clock|The clock says {hour}|{hour} already}.\n\n[half]"
+          r'\u\s[10]{Right|Indeed|Hm, {user}}. {note}\e')
+VALUES = {'face': 5, 'user': 'Sakura', 'hour': 7, 'note': '100% sure \\ maybe'}
+
+def escape(value):
+    return str(value).replace('\\', '\\\\').replace('%', '\\%')
+
+choice = random.choice
+GREETING = ('Good morning', 'Morning', 'Hey there')
+CLOCK = ("It is {0} o'clock", 'The clock says {0}', '{0} already')
+CLOCK_PCT = ("It is %s o'clock", 'The clock says %s', '%s already')
+REPLY = ('Right', 'Indeed', 'Hm, {0}')
+REPLY_PCT = ('Right', 'Indeed', 'Hm, %s')
+
+def with_format(v):
+    user = escape(v['user'])
+    hour = escape(v['hour'])
+    return (r'\h\s[{0}]{1}, {2}.\w9 {3}.\n\n[half]\u\s[10]{4}. {5}\e'.format(
+        escape(v['face']), choice(GREETING), user, choice(CLOCK).format(hour),
+        choice(REPLY).format(user), escape(v['note'])))
+
+def with_percent(v):
+    user = escape(v['user'])
+    hour = escape(v['hour'])
+    reply = choice(REPLY_PCT)
+    return (r'\h\s[%s]%s, %s.\w9 %s.\n\n[half]\u\s[10]%s. %s\e' % (
+        escape(v['face']), choice(GREETING), user, choice(CLOCK_PCT) % hour,
+        reply % user if '%s' in reply else reply, escape(v['note'])))
+
+template = _phiori.Template(SOURCE)
+cases = [
+    ('Template.render(mapping)', lambda: template.render(VALUES)),
+    ('Template.render(**values)', lambda: template.render(**VALUES)),
+    ('str.format + random.choice', lambda: with_format(VALUES)),
+    ('% + random.choice', lambda: with_percent(VALUES)),
+    ('Template.render_bytes(mapping)', lambda: template.render_bytes(VALUES)),
+    ('str.format + encode', lambda: with_format(VALUES).encode('utf-8')),
+    ('% + encode', lambda: with_percent(VALUES).encode('utf-8')),
+]
+
+
+def main(number=100000, repeat=15):
+    # the three renderings produce the same set of outputs.
+    outputs = [set(f() for _ in range(5000)) for f in (cases[0][1], cases[2][1], cases[3][1])]
+    assert outputs[0] == outputs[1] == outputs[2], 'renderings differ'
+    print('python', sys.version.split()[0], '- best of', repeat, 'runs of', number)
+    for name, f in cases:
+        best = min(timeit.repeat(f, number=number, repeat=repeat)) / number
+        print('%-32s %6.2f us' % (name, best * 1e6))
+
+if __name__ == '__main__':
+    main(*(int(arg) for arg in sys.argv[1:3]))
@@ -0,0 +1,189 @@
+#include "coalesce.h"
+#include "message.h"
+#include "strmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include <Python.h>
+
+#define COALESCED_STRING "X-Phiori-Coalesced"
+#define DELTA_X_STRING "X-Phiori-DeltaX"
+#define DELTA_Y_STRING "X-Phiori-DeltaY"
+#define DELTA_WHEEL_STRING "X-Phiori-DeltaWheel"
+
+#define COALESCE_TARGET_MAX 128
+
+typedef struct _COALESCE_RULE {
+    DWORD window;
+    ULONGLONG forwarded_at;
+    char target[COALESCE_TARGET_MAX];
+    long x;
+    long y;
+    long wheel;
+    long absorbed;
+} COALESCE_RULE;
+
+STRMAP coalesceRules;
+SRWLOCK coalesceLock;
+// rule of the previous forwarded event, NULL once the run is broken.
+COALESCE_RULE *coalesceLast;
+volatile LONG64 coalesceForwarded;
+volatile LONG64 coalesceAbsorbed;
+// absorbed events given up because the run moved to another target.
+volatile LONG64 coalesceDropped;
+
+int coalesce_set(const char *id, size_t id_len, DWORD window) {
+    STRMAP_ENTRY *entry = strmap_put(&coalesceRules, id, id_len);
+    if (!entry)
+        return 0;
+    if (!entry->value) {
+        entry->value = calloc(1, sizeof(COALESCE_RULE));
+        if (!entry->value) {
+            strmap_remove(&coalesceRules, id, id_len, NULL);
+            return 0;
+        }
+    }
+    COALESCE_RULE *rule = entry->value;
+    rule->window = window;
+    if (coalesceLast == rule)
+        coalesceLast = NULL;
+    return 1;
+}
+
+int LOAD_Coalesce(void) {
+    InitializeSRWLock(&coalesceLock);
+    coalesceLast = NULL;
+    coalesceForwarded = 0;
+    coalesceAbsorbed = 0;
+    coalesceDropped = 0;
+    return coalesce_set("OnMouseMove", 11, COALESCE_DEFAULT_WINDOW)
+        && coalesce_set("OnMouseWheel", 12, COALESCE_DEFAULT_WINDOW);
+}
+
+int UNLOAD_Coalesce(void) {
+    AcquireSRWLockExclusive(&coalesceLock);
+    coalesceLast = NULL;
+    strmap_clear(&coalesceRules, free);
+    ReleaseSRWLockExclusive(&coalesceLock);
+    return 1;
+}
+
+long coalesce_get_long(const char *raw, size_t len, const char *key) {
+    char buf[32];
+    size_t value_len;
+    const char *value = message_get(raw, len, key, &value_len);
+    if (!value || value_len >= sizeof(buf))
+        return 0;
+    memcpy(buf, value, value_len);
+    buf[value_len] = '\0';
+    return strtol(buf, NULL, 10);
+}
+
+// mouse events name their scope in Reference3 and collision in Reference4.
+void coalesce_get_target(const char *raw, size_t len, char *target) {
+    size_t scope_len, area_len;
+    const char *scope = message_get(raw, len, "Reference3", &scope_len);
+    const char *area = message_get(raw, len, "Reference4", &area_len);
+    if (scope_len + area_len + 2 > COALESCE_TARGET_MAX)
+        scope_len = area_len = 0;
+    if (scope)
+        memcpy(target, scope, scope_len);
+    target[scope_len] = '\x1f';
+    if (area)
+        memcpy(target + scope_len + 1, area, area_len);
+    target[scope_len + 1 + area_len] = '\0';
+}
+
+char *coalesce_rewrite(const char *raw, size_t len, const COALESCE_RULE *rule, long dx, long dy, long *res_len) {
+    // insert before the blank line closing the headers.
+    size_t end = len;
+    while (end >= 2 && raw[end - 1] == '\n' && raw[end - 2] == '\r')
+        end -= 2;
+    char headers[256];
+    int headers_len = sprintf(headers, "\r\n%s: %ld\r\n%s: %ld\r\n%s: %ld\r\n%s: %ld",
+        COALESCED_STRING, rule->absorbed, DELTA_X_STRING, dx, DELTA_Y_STRING, dy, DELTA_WHEEL_STRING, rule->wheel);
+    char *result = malloc(len + headers_len + 1);
+    if (!result)
+        return NULL;
+    memcpy(result, raw, end);
+    memcpy(result + end, headers, headers_len);
+    memcpy(result + end + headers_len, raw + end, len - end);
+    result[len + headers_len] = '\0';
+    *res_len = (long)(len + headers_len);
+    return result;
+}
+
+int coalesce_absorb(const char *raw, size_t len, const char *id, size_t id_len, char **rewritten, long *rewritten_len) {
+    int result = COALESCE_FORWARD;
+    *rewritten = NULL;
+    AcquireSRWLockExclusive(&coalesceLock);
+    STRMAP_ENTRY *entry = strmap_get(&coalesceRules, id, id_len);
+    COALESCE_RULE *rule = entry ? entry->value : NULL;
+    if (!rule || (!rule->window && !rule->absorbed)) {
+        coalesceLast = NULL;
+        ReleaseSRWLockExclusive(&coalesceLock);
+        InterlockedIncrement64(&coalesceForwarded);
+        return result;
+    }
+    char target[COALESCE_TARGET_MAX];
+    coalesce_get_target(raw, len, target);
+    ULONGLONG now = GetTickCount64();
+    long x = coalesce_get_long(raw, len, "Reference0");
+    long y = coalesce_get_long(raw, len, "Reference1");
+    long wheel = coalesce_get_long(raw, len, "Reference2");
+    int continued = rule->window && coalesceLast == rule && strcmp(rule->target, target) == 0;
+    if (continued && now - rule->forwarded_at < rule->window) {
+        rule->absorbed++;
+        rule->wheel += wheel;
+        result = COALESCE_ABSORB;
+    }
+    else {
+        // absorbed events ride on the next forwarded one of their id and target; deltas
+        // from another target would be about something else.
+        if (rule->absorbed && strcmp(rule->target, target) == 0) {
+            rule->wheel += wheel;
+            *rewritten = coalesce_rewrite(raw, len, rule, x - rule->x, y - rule->y, rewritten_len);
+        }
+        else if (rule->absorbed)
+            InterlockedExchangeAdd64(&coalesceDropped, rule->absorbed);
+        strcpy(rule->target, target);
+        rule->forwarded_at = now;
+        rule->x = x;
+        rule->y = y;
+        rule->wheel = 0;
+        rule->absorbed = 0;
+        coalesceLast = rule->window ? rule : NULL;
+    }
+    ReleaseSRWLockExclusive(&coalesceLock);
+    InterlockedIncrement64(result == COALESCE_ABSORB ? &coalesceAbsorbed : &coalesceForwarded);
+    return result;
+}
+
+void coalesce_stats(PyObject *dict) {
+    PyObject *stats = Py_BuildValue("{s:L,s:L,s:L}",
+        "forwarded", (long long)coalesceForwarded,
+        "absorbed", (long long)coalesceAbsorbed,
+        "dropped", (long long)coalesceDropped);
+    if (stats) {
+        PyDict_SetItemString(dict, "coalesce", stats);
+        Py_DECREF(stats);
+    }
+}
+
+PyObject *phiori_coalesce(PyObject *self, PyObject *args) {
+    PyObject *idObj;
+    unsigned long window;
+    if (!PyArg_ParseTuple(args, "Uk", &idObj, &window))
+        return NULL;
+    Py_ssize_t id_len;
+    const char *id = PyUnicode_AsUTF8AndSize(idObj, &id_len);
+    if (!id)
+        return NULL;
+    AcquireSRWLockExclusive(&coalesceLock);
+    int result = coalesce_set(id, (size_t)id_len, (DWORD)window);
+    ReleaseSRWLockExclusive(&coalesceLock);
+    if (!result)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
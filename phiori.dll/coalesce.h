@@ -0,0 +1,20 @@
+#ifndef _PHIORI_COALESCE
+#define _PHIORI_COALESCE 1
+#include <stddef.h>
+#include <Python.h>
+
+#define COALESCE_FORWARD 0
+#define COALESCE_ABSORB 1
+
+#define COALESCE_DEFAULT_WINDOW 50
+
+int LOAD_Coalesce(void);
+int UNLOAD_Coalesce(void);
+// on COALESCE_FORWARD, *rewritten may receive a request carrying the
+// accumulated count and deltas of absorbed events, to be free()d.
+int coalesce_absorb(const char *raw, size_t len, const char *id, size_t id_len, char **rewritten, long *rewritten_len);
+void coalesce_stats(PyObject *dict);
+
+PyObject *phiori_coalesce(PyObject *self, PyObject *args);
+
+#endif
@@ -0,0 +1,812 @@
+#include "dictionary.h"
+#include "log.h"
+#include "module.h"
+#include "strmap.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <Windows.h>
+#include <Python.h>
+
+#define DICTIONARY_MAGIC "PHIORDIC"
+#define DICTIONARY_FORMAT_VERSION 1
+#define DICTIONARY_MIN_SLOTS 16
+#define DICTIONARY_ALIGN(n) (((n) + 7) & ~(size_t)7)
+// pool offsets are kept as pointers while compiling, plus one.
+#define DICTIONARY_MAX_POOL 0x7FFFFFFFu
+#define DICTIONARY_CORRUPT_MESSAGE "dictionary file is corrupt"
+
+/*
+ * Text dictionary:
+ *
+ * # comment
+ * [key]            starts the lines of key; a key given again adds to them
+ * line             one line of dialogue, as it is
+ * (3) line         the same with a weight of 3 for choice(); the default is 1
+ *
+ * A line beginning with # or looking like [key] is written with a (1) prefix.
+ *
+ * Compiled file:
+ *
+ * [header][index][keys][lines][pool]
+ *
+ * The index is an open-addressing table of key numbers plus one, hashed
+ * with strmap_hash. The lines of a key are contiguous and carry running
+ * totals of their weights, so a weighted pick is a binary search. The pool
+ * holds the utf-8 text of keys and lines, each distinct string once.
+ * Offsets into the pool are relative to its start.
+ */
+
+typedef struct _DICTIONARY_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t slots;
+    uint32_t line_count;
+    uint64_t index;
+    uint64_t keys;
+    uint64_t lines;
+    uint64_t pool;
+    uint64_t size;
+} DICTIONARY_HEADER;
+
+typedef struct _DICTIONARY_KEY {
+    uint32_t hash;
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t first;
+    uint32_t line_count;
+    uint32_t reserved;
+    uint64_t total;
+} DICTIONARY_KEY;
+
+typedef struct _DICTIONARY_LINE {
+    uint32_t text;
+    uint32_t len;
+    // weights of the lines of the key up to this one.
+    uint64_t cumulative;
+} DICTIONARY_LINE;
+
+typedef struct _DICTIONARY {
+    const char *view;
+    size_t size;
+    const DICTIONARY_HEADER *header;
+    const uint32_t *index;
+    const DICTIONARY_KEY *keys;
+    const DICTIONARY_LINE *lines;
+    const char *pool;
+    size_t pool_size;
+} DICTIONARY;
+
+typedef struct _DICTIONARY_SOURCE_KEY {
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t hash;
+    uint32_t first;
+    uint32_t line_count;
+    uint32_t fill;
+    uint64_t total;
+} DICTIONARY_SOURCE_KEY;
+
+typedef struct _DICTIONARY_ENTRY {
+    uint32_t key;
+    uint32_t text;
+    uint32_t len;
+    uint32_t weight;
+} DICTIONARY_ENTRY;
+
+typedef struct _DICTIONARY_COMPILER {
+    // name -> key number plus one.
+    STRMAP names;
+    DICTIONARY_SOURCE_KEY *keys;
+    size_t key_count;
+    size_t key_capacity;
+    DICTIONARY_ENTRY *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    // text -> pool offset plus one.
+    STRMAP pool;
+    size_t pool_size;
+    unsigned int line;
+    char *error;
+    size_t error_size;
+} DICTIONARY_COMPILER;
+
+typedef struct _DictionaryObject {
+    PyObject_HEAD
+    DICTIONARY *dict;
+    DICTIONARY own;
+} DictionaryObject;
+
+DICTIONARY dictionaryMain;
+uint64_t dictionaryRandom;
+
+LONG64 dictionaryLookups;
+LONG64 dictionaryChoices;
+LONG64 dictionaryStrings;
+
+uint64_t dictionary_random(uint64_t n) {
+    // xorshift64*
+    dictionaryRandom ^= dictionaryRandom >> 12;
+    dictionaryRandom ^= dictionaryRandom << 25;
+    dictionaryRandom ^= dictionaryRandom >> 27;
+    return (dictionaryRandom * 2685821657736338717ULL) % n;
+}
+
+int dictionary_valid(const DICTIONARY_HEADER *header, size_t size) {
+    if (size < sizeof(DICTIONARY_HEADER) || memcmp(header->magic, DICTIONARY_MAGIC, sizeof(header->magic)) != 0
+        || header->version != DICTIONARY_FORMAT_VERSION || header->size != size)
+        return 0;
+    uint32_t slots = header->slots;
+    return slots && (slots & (slots - 1)) == 0 && header->count < slots
+        && header->index >= sizeof(DICTIONARY_HEADER) && header->index % sizeof(uint32_t) == 0
+        && header->keys % 8 == 0 && header->lines % 8 == 0
+        && header->index <= size && header->keys <= size && header->lines <= size && header->pool <= size
+        && header->index + (uint64_t)slots * sizeof(uint32_t) <= header->keys
+        && header->keys + (uint64_t)header->count * sizeof(DICTIONARY_KEY) <= header->lines
+        && header->lines + (uint64_t)header->line_count * sizeof(DICTIONARY_LINE) <= header->pool;
+}
+
+void dictionary_close(DICTIONARY *dict) {
+    if (dict->view)
+        UnmapViewOfFile(dict->view);
+    memset(dict, 0, sizeof(DICTIONARY));
+}
+
+// maps path read-only; entries are checked as they are used, so opening costs the same for any size.
+int dictionary_open(DICTIONARY *dict, const wchar_t *path) {
+    memset(dict, 0, sizeof(DICTIONARY));
+    // sharing delete lets a new build be renamed over a mapped file.
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (!GetFileSizeEx(file, &size))
+        size.QuadPart = 0;
+    else if ((uint64_t)size.QuadPart < sizeof(DICTIONARY_HEADER) || (uint64_t)size.QuadPart > SIZE_MAX)
+        SetLastError(ERROR_BAD_FORMAT);
+    else
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+        dict->view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+    }
+    // the view keeps the file open.
+    DWORD error = GetLastError();
+    CloseHandle(file);
+    SetLastError(error);
+    if (!dict->view)
+        return 0;
+    const DICTIONARY_HEADER *header = (const DICTIONARY_HEADER *)dict->view;
+    if (!dictionary_valid(header, (size_t)size.QuadPart)) {
+        dictionary_close(dict);
+        SetLastError(ERROR_BAD_FORMAT);
+        return 0;
+    }
+    dict->size = (size_t)size.QuadPart;
+    dict->header = header;
+    dict->index = (const uint32_t *)(dict->view + header->index);
+    dict->keys = (const DICTIONARY_KEY *)(dict->view + header->keys);
+    dict->lines = (const DICTIONARY_LINE *)(dict->view + header->lines);
+    dict->pool = dict->view + header->pool;
+    dict->pool_size = dict->size - (size_t)header->pool;
+    return 1;
+}
+
+int dictionary_valid_key(const DICTIONARY *dict, const DICTIONARY_KEY *key) {
+    return key->name <= dict->pool_size && key->name_len <= dict->pool_size - key->name
+        && key->first <= dict->header->line_count && key->line_count <= dict->header->line_count - key->first;
+}
+
+const DICTIONARY_KEY *dictionary_find(const DICTIONARY *dict, const char *name, size_t len) {
+    uint32_t hash = strmap_hash(name, len);
+    uint32_t mask = dict->header->slots - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+        uint32_t number = dict->index[i];
+        if (!number)
+            break;
+        if (number > dict->header->count)
+            continue;
+        const DICTIONARY_KEY *key = &dict->keys[number - 1];
+        if (key->hash == hash && key->name_len == len && dictionary_valid_key(dict, key)
+            && memcmp(dict->pool + key->name, name, len) == 0)
+            return key;
+    }
+    return NULL;
+}
+
+// the pick for r below the total weight of key.
+const DICTIONARY_LINE *dictionary_pick(const DICTIONARY *dict, const DICTIONARY_KEY *key, uint64_t r) {
+    const DICTIONARY_LINE *lines = dict->lines + key->first;
+    uint32_t low = 0, high = key->line_count - 1;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (lines[mid].cumulative > r)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return &lines[low];
+}
+
+int dictionary_grow(void **array, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity)
+        return 1;
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    void *p = realloc(*array, grown * size);
+    if (!p) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    *array = p;
+    *capacity = grown;
+    return 1;
+}
+
+int dictionary_syntax(DICTIONARY_COMPILER *c, const char *message) {
+    snprintf(c->error, c->error_size, "line %u: %s", c->line, message);
+    SetLastError(ERROR_BAD_FORMAT);
+    return 0;
+}
+
+int dictionary_intern(DICTIONARY_COMPILER *c, const char *text, size_t len, uint32_t *offset) {
+    STRMAP_ENTRY *entry = strmap_put(&c->pool, text, len);
+    if (!entry) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    if (!entry->value) {
+        if (len > DICTIONARY_MAX_POOL - c->pool_size)
+            return dictionary_syntax(c, "dictionary is too large");
+        entry->value = (void *)(uintptr_t)(c->pool_size + 1);
+        c->pool_size += len;
+    }
+    *offset = (uint32_t)((uintptr_t)entry->value - 1);
+    return 1;
+}
+
+// the number of key plus one, or 0 on failure.
+uint32_t dictionary_section(DICTIONARY_COMPILER *c, const char *name, size_t len) {
+    STRMAP_ENTRY *entry = strmap_put(&c->names, name, len);
+    if (!entry) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    if (entry->value)
+        return (uint32_t)(uintptr_t)entry->value;
+    if (c->key_count == UINT32_MAX / 2)
+        return dictionary_syntax(c, "too many keys");
+    if (!dictionary_grow((void **)&c->keys, &c->key_capacity, c->key_count, sizeof(DICTIONARY_SOURCE_KEY)))
+        return 0;
+    DICTIONARY_SOURCE_KEY *key = &c->keys[c->key_count];
+    memset(key, 0, sizeof(DICTIONARY_SOURCE_KEY));
+    if (!dictionary_intern(c, name, len, &key->name))
+        return 0;
+    key->name_len = (uint32_t)len;
+    key->hash = strmap_hash(name, len);
+    c->key_count++;
+    entry->value = (void *)(uintptr_t)c->key_count;
+    return (uint32_t)c->key_count;
+}
+
+int dictionary_entry(DICTIONARY_COMPILER *c, uint32_t key, const char *text, size_t len) {
+    uint64_t weight = 1;
+    // "(n) " sets the weight; anything else in parentheses is part of the line.
+    if (len > 3 && text[0] == '(' && text[1] >= '0' && text[1] <= '9') {
+        size_t i = 1;
+        uint64_t n = 0;
+        for (; i < len && text[i] >= '0' && text[i] <= '9'; i++)
+            if (n <= UINT32_MAX)
+                n = n * 10 + (text[i] - '0');
+        if (i + 1 < len && text[i] == ')' && text[i + 1] == ' ') {
+            if (n > UINT32_MAX)
+                return dictionary_syntax(c, "weight is too large");
+            weight = n;
+            text += i + 2;
+            len -= i + 2;
+        }
+    }
+    if (c->entry_count == UINT32_MAX)
+        return dictionary_syntax(c, "too many lines");
+    if (!dictionary_grow((void **)&c->entries, &c->entry_capacity, c->entry_count, sizeof(DICTIONARY_ENTRY)))
+        return 0;
+    DICTIONARY_ENTRY *entry = &c->entries[c->entry_count];
+    if (!dictionary_intern(c, text, len, &entry->text))
+        return 0;
+    entry->key = key - 1;
+    entry->len = (uint32_t)len;
+    entry->weight = (uint32_t)weight;
+    c->keys[key - 1].line_count++;
+    c->entry_count++;
+    return 1;
+}
+
+int dictionary_parse(DICTIONARY_COMPILER *c, const char *text, size_t len) {
+    const char *p = text, *end = text + len;
+    if (len >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+        p += 3;
+    uint32_t key = 0;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *next = eol ? eol + 1 : end;
+        if (!eol)
+            eol = end;
+        if (eol > p && eol[-1] == '\r')
+            eol--;
+        c->line++;
+        const char *last = eol;
+        while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+            last--;
+        if (last == p || *p == '#') {
+            p = next;
+            continue;
+        }
+        if (*p == '[' && last[-1] == ']') {
+            if (last - p == 2)
+                return dictionary_syntax(c, "empty key");
+            key = dictionary_section(c, p + 1, last - p - 2);
+            if (!key)
+                return 0;
+        }
+        else if (!key)
+            return dictionary_syntax(c, "line before the first [key]");
+        else if (!dictionary_entry(c, key, p, eol - p))
+            return 0;
+        p = next;
+    }
+    return 1;
+}
+
+char *dictionary_build(DICTIONARY_COMPILER *c, size_t *size) {
+    size_t slots = DICTIONARY_MIN_SLOTS;
+    while (slots < c->key_count * 2)
+        slots *= 2;
+    size_t index = sizeof(DICTIONARY_HEADER);
+    size_t keys = DICTIONARY_ALIGN(index + slots * sizeof(uint32_t));
+    size_t lines = keys + c->key_count * sizeof(DICTIONARY_KEY);
+    size_t pool = lines + c->entry_count * sizeof(DICTIONARY_LINE);
+    *size = pool + c->pool_size;
+    char *view = calloc(*size, 1);
+    if (!view) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    DICTIONARY_HEADER *header = (DICTIONARY_HEADER *)view;
+    memcpy(header->magic, DICTIONARY_MAGIC, sizeof(header->magic));
+    header->version = DICTIONARY_FORMAT_VERSION;
+    header->count = (uint32_t)c->key_count;
+    header->slots = (uint32_t)slots;
+    header->line_count = (uint32_t)c->entry_count;
+    header->index = index;
+    header->keys = keys;
+    header->lines = lines;
+    header->pool = pool;
+    header->size = *size;
+    // lines of a key end up in the order they were read.
+    uint32_t first = 0;
+    for (size_t i = 0; i < c->key_count; i++) {
+        c->keys[i].first = c->keys[i].fill = first;
+        first += c->keys[i].line_count;
+    }
+    DICTIONARY_LINE *line_table = (DICTIONARY_LINE *)(view + lines);
+    for (size_t i = 0; i < c->entry_count; i++) {
+        const DICTIONARY_ENTRY *entry = &c->entries[i];
+        DICTIONARY_SOURCE_KEY *key = &c->keys[entry->key];
+        DICTIONARY_LINE *line = &line_table[key->fill++];
+        key->total += entry->weight;
+        line->text = entry->text;
+        line->len = entry->len;
+        line->cumulative = key->total;
+    }
+    uint32_t *index_table = (uint32_t *)(view + index);
+    DICTIONARY_KEY *key_table = (DICTIONARY_KEY *)(view + keys);
+    for (size_t i = 0; i < c->key_count; i++) {
+        const DICTIONARY_SOURCE_KEY *source = &c->keys[i];
+        DICTIONARY_KEY *key = &key_table[i];
+        key->hash = source->hash;
+        key->name = source->name;
+        key->name_len = source->name_len;
+        key->first = source->first;
+        key->line_count = source->line_count;
+        key->total = source->total;
+        size_t slot = source->hash & (slots - 1);
+        while (index_table[slot])
+            slot = (slot + 1) & (slots - 1);
+        index_table[slot] = (uint32_t)(i + 1);
+    }
+    STRMAP_FOREACH(c->pool, entry)
+        memcpy(view + pool + ((uintptr_t)entry->value - 1), entry->key, entry->len);
+    return view;
+}
+
+char *dictionary_read(const wchar_t *path, size_t *len) {
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    char *data = NULL;
+    LARGE_INTEGER size;
+    DWORD read = 0;
+    if (!GetFileSizeEx(file, &size))
+        size.QuadPart = 0;
+    else if ((uint64_t)size.QuadPart > DICTIONARY_MAX_POOL)
+        SetLastError(ERROR_FILE_TOO_LARGE);
+    else {
+        data = malloc((size_t)size.QuadPart + 1);
+        if (!data)
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        else if (!ReadFile(file, data, (DWORD)size.QuadPart, &read, NULL) || read != (DWORD)size.QuadPart) {
+            free(data);
+            data = NULL;
+        }
+    }
+    DWORD error = GetLastError();
+    CloseHandle(file);
+    SetLastError(error);
+    *len = read;
+    return data;
+}
+
+int dictionary_write(const wchar_t *target, const char *data, size_t size) {
+    wchar_t *temp = calloc(wcslen(target) + wcslen(DICTIONARY_TEMP_SUFFIX_W) + 1, sizeof(wchar_t));
+    if (!temp) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    wcscpy(temp, target);
+    wcscat(temp, DICTIONARY_TEMP_SUFFIX_W);
+    int result = 0;
+    HANDLE file = CreateFileW(temp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file != INVALID_HANDLE_VALUE) {
+        DWORD written;
+        result = WriteFile(file, data, (DWORD)size, &written, NULL) && written == size && FlushFileBuffers(file);
+        DWORD error = GetLastError();
+        CloseHandle(file);
+        // a reader never sees half a dictionary.
+        if (result && !MoveFileExW(temp, target, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            error = GetLastError();
+            result = 0;
+        }
+        if (!result)
+            DeleteFileW(temp);
+        SetLastError(error);
+    }
+    free(temp);
+    return result;
+}
+
+int dictionary_compile(const wchar_t *source, const wchar_t *target, char *error, size_t error_size) {
+    DICTIONARY_COMPILER c;
+    memset(&c, 0, sizeof(c));
+    c.error = error;
+    c.error_size = error_size;
+    if (error_size)
+        error[0] = '\0';
+    size_t len = 0, size = 0;
+    char *text = dictionary_read(source, &len);
+    char *view = NULL;
+    if (text && dictionary_parse(&c, text, len))
+        view = dictionary_build(&c, &size);
+    int result = view && dictionary_write(target, view, size);
+    DWORD last = GetLastError();
+    free(view);
+    free(text);
+    free(c.entries);
+    free(c.keys);
+    strmap_clear(&c.pool, NULL);
+    strmap_clear(&c.names, NULL);
+    SetLastError(last);
+    return result;
+}
+
+// rundll32 phiori.dll,CompileDictionary source target
+#pragma comment(linker, "/EXPORT:CompileDictionaryW=_CompileDictionaryW@16")
+void CALLBACK CompileDictionaryW(HWND hwnd, HINSTANCE instance, LPWSTR command_line, int show) {
+    int argc;
+    wchar_t **argv = CommandLineToArgvW(command_line, &argc);
+    wchar_t message[BUFSIZ];
+    if (!argv || argc != 2) {
+        MessageBoxW(hwnd, L"Usage: rundll32 phiori.dll,CompileDictionary source target", L"phiori", MB_ICONINFORMATION);
+        if (argv)
+            LocalFree(argv);
+        return;
+    }
+    char error[BUFSIZ];
+    if (!dictionary_compile(argv[0], argv[1], error, sizeof(error))) {
+        DWORD last = GetLastError();
+        wcsncpy(message, argv[0], BUFSIZ / 2);
+        message[BUFSIZ / 2] = L'\0';
+        wcscat(message, L": ");
+        size_t n = wcslen(message);
+        if (error[0])
+            MultiByteToWideChar(CP_UTF8, 0, error, -1, message + n, (int)(BUFSIZ - n));
+        else if (!FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, last, 0, message + n, (DWORD)(BUFSIZ - n), NULL))
+            message[n] = L'\0';
+        MessageBoxW(hwnd, message, L"phiori", MB_ICONERROR);
+    }
+    LocalFree(argv);
+}
+
+int LOAD_Dictionary(const wchar_t *rootW) {
+    LARGE_INTEGER seed;
+    QueryPerformanceCounter(&seed);
+    dictionaryRandom = (uint64_t)seed.QuadPart ^ ((uint64_t)GetCurrentProcessId() << 32) ^ 0x9E3779B97F4A7C15ULL;
+    if (!dictionaryRandom)
+        dictionaryRandom = 1;
+    wchar_t *path = calloc(wcslen(rootW) + wcslen(DICTIONARY_FILE_NAME_W) + 1, sizeof(wchar_t));
+    if (!path)
+        return 0;
+    wcscpy(path, rootW);
+    wcscat(path, DICTIONARY_FILE_NAME_W);
+    int result = 1;
+    // a ghost without one gets None as phiori.dictionary.
+    if (GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES && !dictionary_open(&dictionaryMain, path)) {
+        log_print(LOG_PHIORI, "Failed to open phiori.dic.");
+        result = 0;
+    }
+    free(path);
+    return result;
+}
+
+int UNLOAD_Dictionary(void) {
+    dictionary_close(&dictionaryMain);
+    return 1;
+}
+
+void dictionary_stats(PyObject *dict) {
+    PyObject *stats = Py_BuildValue("{s:O,s:I,s:I,s:n,s:L,s:L,s:L}",
+        "open", dictionaryMain.view ? Py_True : Py_False,
+        "keys", dictionaryMain.view ? (unsigned int)dictionaryMain.header->count : 0U,
+        "lines", dictionaryMain.view ? (unsigned int)dictionaryMain.header->line_count : 0U,
+        "bytes", (Py_ssize_t)dictionaryMain.size,
+        "lookups", (long long)dictionaryLookups,
+        "choices", (long long)dictionaryChoices,
+        "strings", (long long)dictionaryStrings);
+    if (stats) {
+        PyDict_SetItemString(dict, "dictionary", stats);
+        Py_DECREF(stats);
+    }
+}
+
+// the entry of key, or NULL with KeyError set.
+const DICTIONARY_KEY *dictionary_lookup(DictionaryObject *self, PyObject *key) {
+    if (!PyUnicode_Check(key)) {
+        PyErr_Format(PyExc_TypeError, "dictionary keys must be str, not %.200s", Py_TYPE(key)->tp_name);
+        return NULL;
+    }
+    Py_ssize_t len;
+    const char *name = PyUnicode_AsUTF8AndSize(key, &len);
+    if (!name)
+        return NULL;
+    dictionaryLookups++;
+    const DICTIONARY_KEY *result = dictionary_find(self->dict, name, len);
+    if (!result)
+        PyErr_SetObject(PyExc_KeyError, key);
+    return result;
+}
+
+PyObject *dictionary_line(DictionaryObject *self, const DICTIONARY_LINE *line) {
+    if (line->text > self->dict->pool_size || line->len > self->dict->pool_size - line->text) {
+        PyErr_SetString(PyExc_ValueError, DICTIONARY_CORRUPT_MESSAGE);
+        return NULL;
+    }
+    dictionaryStrings++;
+    return PyUnicode_DecodeUTF8(self->dict->pool + line->text, line->len, "replace");
+}
+
+PyObject *dictionary_lines(DictionaryObject *self, const DICTIONARY_KEY *key) {
+    PyObject *result = PyTuple_New(key->line_count);
+    if (!result)
+        return NULL;
+    for (uint32_t i = 0; i < key->line_count; i++) {
+        PyObject *line = dictionary_line(self, &self->dict->lines[key->first + i]);
+        if (!line) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(result, i, line);
+    }
+    return result;
+}
+
+// takes KeyError as a miss when there is a default.
+PyObject *dictionary_default(PyObject *def) {
+    if (!def || !PyErr_ExceptionMatches(PyExc_KeyError))
+        return NULL;
+    PyErr_Clear();
+    Py_INCREF(def);
+    return def;
+}
+
+Py_ssize_t phiori_dictionary_length(DictionaryObject *self) {
+    return self->dict->header->count;
+}
+
+PyObject *phiori_dictionary_subscript(DictionaryObject *self, PyObject *key) {
+    const DICTIONARY_KEY *entry = dictionary_lookup(self, key);
+    return entry ? dictionary_lines(self, entry) : NULL;
+}
+
+int phiori_dictionary_contains(DictionaryObject *self, PyObject *key) {
+    if (dictionary_lookup(self, key))
+        return 1;
+    if (!PyErr_ExceptionMatches(PyExc_KeyError))
+        return -1;
+    PyErr_Clear();
+    return 0;
+}
+
+PyObject *phiori_dictionary_keys(DictionaryObject *self, PyObject *args) {
+    const DICTIONARY *dict = self->dict;
+    PyObject *result = PyList_New(dict->header->count);
+    if (!result)
+        return NULL;
+    for (uint32_t i = 0; i < dict->header->count; i++) {
+        const DICTIONARY_KEY *key = &dict->keys[i];
+        PyObject *name = dictionary_valid_key(dict, key) ? PyUnicode_DecodeUTF8(dict->pool + key->name, key->name_len, "replace") : NULL;
+        if (!name) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, DICTIONARY_CORRUPT_MESSAGE);
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, name);
+    }
+    return result;
+}
+
+PyObject *phiori_dictionary_iter(DictionaryObject *self) {
+    PyObject *keys = phiori_dictionary_keys(self, NULL);
+    if (!keys)
+        return NULL;
+    PyObject *result = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+    return result;
+}
+
+PyObject *phiori_dictionary_get(DictionaryObject *self, PyObject *args) {
+    PyObject *key, *def = Py_None;
+    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &def))
+        return NULL;
+    const DICTIONARY_KEY *entry = dictionary_lookup(self, key);
+    return entry ? dictionary_lines(self, entry) : dictionary_default(def);
+}
+
+PyObject *phiori_dictionary_count(DictionaryObject *self, PyObject *key) {
+    const DICTIONARY_KEY *entry = dictionary_lookup(self, key);
+    if (entry)
+        return PyLong_FromUnsignedLong(entry->line_count);
+    if (!PyErr_ExceptionMatches(PyExc_KeyError))
+        return NULL;
+    PyErr_Clear();
+    return PyLong_FromLong(0);
+}
+
+PyObject *phiori_dictionary_choice(DictionaryObject *self, PyObject *args) {
+    PyObject *key, *def = NULL;
+    if (!PyArg_UnpackTuple(args, "choice", 1, 2, &key, &def))
+        return NULL;
+    const DICTIONARY_KEY *entry = dictionary_lookup(self, key);
+    if (entry && (!entry->line_count || !entry->total)) {
+        // nothing to pick from counts as a miss.
+        PyErr_SetObject(PyExc_KeyError, key);
+        entry = NULL;
+    }
+    if (!entry)
+        return dictionary_default(def);
+    dictionaryChoices++;
+    return dictionary_line(self, dictionary_pick(self->dict, entry, dictionary_random(entry->total)));
+}
+
+PyObject *phiori_dictionary_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"path", NULL};
+    PyObject *path;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U:Dictionary", keywords, &path))
+        return NULL;
+    wchar_t *pathW = PyUnicode_AsWideCharString(path, NULL);
+    if (!pathW)
+        return NULL;
+    DictionaryObject *self = (DictionaryObject *)type->tp_alloc(type, 0);
+    if (self) {
+        if (dictionary_open(&self->own, pathW))
+            self->dict = &self->own;
+        else {
+            PyErr_SetFromWindowsErr(0);
+            Py_CLEAR(self);
+        }
+    }
+    PyMem_Free(pathW);
+    return (PyObject *)self;
+}
+
+void phiori_dictionary_dealloc(DictionaryObject *self) {
+    dictionary_close(&self->own);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyObject *phiori_compile_dictionary(PyObject *self, PyObject *args) {
+    PyObject *source, *target;
+    if (!PyArg_ParseTuple(args, "UU:compile_dictionary", &source, &target))
+        return NULL;
+    wchar_t *sourceW = PyUnicode_AsWideCharString(source, NULL);
+    wchar_t *targetW = sourceW ? PyUnicode_AsWideCharString(target, NULL) : NULL;
+    if (!targetW) {
+        PyMem_Free(sourceW);
+        return NULL;
+    }
+    char error[BUFSIZ];
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = dictionary_compile(sourceW, targetW, error, sizeof(error));
+    Py_END_ALLOW_THREADS
+    PyMem_Free(targetW);
+    PyMem_Free(sourceW);
+    if (result)
+        Py_RETURN_NONE;
+    if (error[0])
+        PyErr_Format(PyExc_ValueError, "%U, %s", source, error);
+    else
+        PyErr_SetFromWindowsErr(0);
+    return NULL;
+}
+
+PyMappingMethods phioriDictionaryAsMapping = {
+    (lenfunc)phiori_dictionary_length,
+    (binaryfunc)phiori_dictionary_subscript,
+    NULL
+};
+
+PySequenceMethods phioriDictionaryAsSequence = {
+    .sq_contains = (objobjproc)phiori_dictionary_contains
+};
+
+PyMethodDef phioriDictionaryMethods[] = {
+    {"get", (PyCFunction)phiori_dictionary_get, METH_VARARGS,
+        "get(key, default=None) -> tuple"},
+    {"choice", (PyCFunction)phiori_dictionary_choice, METH_VARARGS,
+        "choice(key[, default]) -> str\n\nOne line of key at random by weight, without reading the others."},
+    {"count", (PyCFunction)phiori_dictionary_count, METH_O,
+        "count(key) -> int\n\nNumber of lines of key; 0 if there is no such key."},
+    {"keys", (PyCFunction)phiori_dictionary_keys, METH_NOARGS,
+        "keys() -> list"},
+    {NULL, NULL, 0, NULL}
+};
+
+PyTypeObject phioriDictionaryType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = PHIORI_MODULE_NAME ".Dictionary",
+    .tp_basicsize = sizeof(DictionaryObject),
+    .tp_dealloc = (destructor)phiori_dictionary_dealloc,
+    .tp_as_sequence = &phioriDictionaryAsSequence,
+    .tp_as_mapping = &phioriDictionaryAsMapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Dictionary(path)\n\nRead-only mapping of keys to tuples of lines, served from a file written by\n"
+        "compile_dictionary() without loading it. Strings are made only for the lines returned.",
+    .tp_iter = (getiterfunc)phiori_dictionary_iter,
+    .tp_methods = phioriDictionaryMethods,
+    .tp_new = phiori_dictionary_new
+};
+
+int dictionary_init_module(PyObject *module) {
+    if (PyType_Ready(&phioriDictionaryType) < 0)
+        return 0;
+    Py_INCREF(&phioriDictionaryType);
+    if (PyModule_AddObject(module, "Dictionary", (PyObject *)&phioriDictionaryType) < 0)
+        return 0;
+    PyObject *dictionary = Py_None;
+    if (dictionaryMain.view) {
+        DictionaryObject *self = PyObject_New(DictionaryObject, &phioriDictionaryType);
+        if (!self)
+            return 0;
+        memset(&self->own, 0, sizeof(DICTIONARY));
+        // closed by UNLOAD_Dictionary after python is gone.
+        self->dict = &dictionaryMain;
+        dictionary = (PyObject *)self;
+    }
+    else
+        Py_INCREF(dictionary);
+    return PyModule_AddObject(module, "dictionary", dictionary) == 0;
+}
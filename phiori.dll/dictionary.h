@@ -0,0 +1,21 @@
+#ifndef _PHIORI_DICTIONARY
+#define _PHIORI_DICTIONARY 1
+#include <stddef.h>
+#include <wchar.h>
+#include <Python.h>
+
+#define DICTIONARY_FILE_NAME_W L"phiori.dic"
+#define DICTIONARY_TEMP_SUFFIX_W L".tmp"
+
+// maps phiori.dic of the ghost, if there is one.
+int LOAD_Dictionary(const wchar_t *rootW);
+int UNLOAD_Dictionary(void);
+// compiles a utf-8 text dictionary into target. On a syntax error error holds the message;
+// otherwise it is empty and GetLastError() tells what failed.
+int dictionary_compile(const wchar_t *source, const wchar_t *target, char *error, size_t error_size);
+int dictionary_init_module(PyObject *module);
+void dictionary_stats(PyObject *dict);
+
+PyObject *phiori_compile_dictionary(PyObject *self, PyObject *args);
+
+#endif
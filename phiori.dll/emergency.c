@@ -1,4 +1,5 @@
 #include "emergency.h"
+#include "message.h"
 #include "phiori.h"
 #include "shiori.h"
 #include <ctype.h>
@@ -8,15 +9,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define SHIORI2_VERSION_MAGIC "SHIORI/2"
-#define SHIORI3_VERSION_MAGIC "SHIORI/3"
-#define SHIORI25_VERSION_STRING SHIORI2_VERSION_MAGIC ".5"
-#define SHIORI30_VERSION_STRING SHIORI3_VERSION_MAGIC ".0"
-#define SHIORI_200 "200 OK"
-#define SHIORI_204 "204 No Content"
-#define SHIORI_400 "400 Bad Request"
-#define SHIORI_500 "500 Internal Server Error"
-
 #define GET_STRING "GET"
 #define VERSION_STRING "Version"
 #define SENTENCE_STRING "Sentence"
@@ -0,0 +1,158 @@
+#include "filter.h"
+#include "strmap.h"
+#include <stdlib.h>
+#include <Windows.h>
+#include <Python.h>
+
+STRMAP filterSet;
+SRWLOCK filterLock;
+volatile LONG filterEnabled;
+volatile LONG64 filterHits;
+volatile LONG64 filterSkips;
+
+int LOAD_Filter(void) {
+    InitializeSRWLock(&filterLock);
+    filterEnabled = 0;
+    filterHits = 0;
+    filterSkips = 0;
+    return 1;
+}
+
+int UNLOAD_Filter(void) {
+    AcquireSRWLockExclusive(&filterLock);
+    strmap_clear(&filterSet, NULL);
+    filterEnabled = 0;
+    ReleaseSRWLockExclusive(&filterLock);
+    return 1;
+}
+
+int filter_accepts(const char *id, size_t len) {
+    int result = 1;
+    // resource requests such as version and name are never filtered, only On* events.
+    if (filterEnabled && len > 2 && id[0] == 'O' && id[1] == 'n') {
+        AcquireSRWLockShared(&filterLock);
+        if (filterEnabled)
+            result = strmap_get(&filterSet, id, len) != NULL;
+        ReleaseSRWLockShared(&filterLock);
+    }
+    if (result)
+        InterlockedIncrement64(&filterHits);
+    else
+        InterlockedIncrement64(&filterSkips);
+    return result;
+}
+
+void filter_stats(PyObject *dict) {
+    PyObject *stats = Py_BuildValue("{s:L,s:L,s:n}",
+        "hits", (long long)filterHits,
+        "skips", (long long)filterSkips,
+        "subscriptions", (Py_ssize_t)(filterEnabled ? filterSet.count : 0));
+    if (stats) {
+        PyDict_SetItemString(dict, "filter", stats);
+        Py_DECREF(stats);
+    }
+}
+
+// utf-8 of every argument, or NULL with an error set; the strings belong to args.
+const char **filter_ids(PyObject *args, size_t **lens) {
+    Py_ssize_t count = PyTuple_GET_SIZE(args);
+    const char **ids = malloc((count ? count : 1) * sizeof(const char *));
+    *lens = malloc((count ? count : 1) * sizeof(size_t));
+    if (!ids || !*lens) {
+        free(ids);
+        free(*lens);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject *arg = PyTuple_GET_ITEM(args, i);
+        Py_ssize_t len;
+        ids[i] = PyUnicode_Check(arg) ? PyUnicode_AsUTF8AndSize(arg, &len) : NULL;
+        if (!ids[i]) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError, "event id must be str");
+            free(ids);
+            free(*lens);
+            return NULL;
+        }
+        (*lens)[i] = (size_t)len;
+    }
+    return ids;
+}
+
+PyObject *phiori_subscribe(PyObject *self, PyObject *args) {
+    Py_ssize_t count = PyTuple_GET_SIZE(args);
+    size_t *lens;
+    const char **ids = filter_ids(args, &lens);
+    if (!ids)
+        return NULL;
+    Py_ssize_t added = 0;
+    AcquireSRWLockExclusive(&filterLock);
+    for (; added < count; added++) {
+        if (strmap_get(&filterSet, ids[added], lens[added]))
+            ids[added] = NULL;
+        else if (!strmap_put(&filterSet, ids[added], lens[added]))
+            break;
+    }
+    if (added < count) {
+        // leaves the subscriptions as they were.
+        for (Py_ssize_t i = 0; i < added; i++)
+            if (ids[i])
+                strmap_remove(&filterSet, ids[i], lens[i], NULL);
+    }
+    else if (filterSet.count)
+        filterEnabled = 1;
+    ReleaseSRWLockExclusive(&filterLock);
+    free(ids);
+    free(lens);
+    if (added < count)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+PyObject *phiori_unsubscribe(PyObject *self, PyObject *args) {
+    Py_ssize_t count = PyTuple_GET_SIZE(args);
+    size_t *lens;
+    const char **ids = filter_ids(args, &lens);
+    if (!ids)
+        return NULL;
+    AcquireSRWLockExclusive(&filterLock);
+    for (Py_ssize_t i = 0; i < count; i++)
+        strmap_remove(&filterSet, ids[i], lens[i], NULL);
+    // an empty set passes everything again rather than muting the ghost.
+    if (!filterSet.count)
+        filterEnabled = 0;
+    ReleaseSRWLockExclusive(&filterLock);
+    free(ids);
+    free(lens);
+    Py_RETURN_NONE;
+}
+
+PyObject *phiori_subscriptions(PyObject *self, PyObject *args) {
+    if (!filterEnabled)
+        Py_RETURN_NONE;
+    PyObject *result = PySet_New(NULL);
+    if (!result)
+        return NULL;
+    AcquireSRWLockShared(&filterLock);
+    STRMAP_FOREACH(filterSet, entry) {
+        PyObject *id = PyUnicode_FromStringAndSize(entry->key, (Py_ssize_t)entry->len);
+        if (!id || PySet_Add(result, id) < 0) {
+            Py_XDECREF(id);
+            ReleaseSRWLockShared(&filterLock);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(id);
+    }
+    ReleaseSRWLockShared(&filterLock);
+    return result;
+}
+
+PyObject *phiori_clear_subscriptions(PyObject *self, PyObject *args) {
+    AcquireSRWLockExclusive(&filterLock);
+    strmap_clear(&filterSet, NULL);
+    filterEnabled = 0;
+    ReleaseSRWLockExclusive(&filterLock);
+    Py_RETURN_NONE;
+}
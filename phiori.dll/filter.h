@@ -0,0 +1,17 @@
+#ifndef _PHIORI_FILTER
+#define _PHIORI_FILTER 1
+#include <stddef.h>
+#include <Python.h>
+
+int LOAD_Filter(void);
+int UNLOAD_Filter(void);
+// safe without the GIL; everything passes until python subscribes.
+int filter_accepts(const char *id, size_t len);
+void filter_stats(PyObject *dict);
+
+PyObject *phiori_subscribe(PyObject *self, PyObject *args);
+PyObject *phiori_unsubscribe(PyObject *self, PyObject *args);
+PyObject *phiori_subscriptions(PyObject *self, PyObject *args);
+PyObject *phiori_clear_subscriptions(PyObject *self, PyObject *args);
+
+#endif
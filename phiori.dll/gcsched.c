@@ -0,0 +1,272 @@
+#include "gcsched.h"
+#include "store.h"
+#include <Windows.h>
+#include <Python.h>
+
+PyObject *gcModule;
+PyObject *gcCollect;
+PyObject *gcGetCount;
+
+int gcEnabled;
+DWORD gcIdle;
+DWORD gcBudget;
+long gcLimit;
+long gcThreshold[3];
+
+HANDLE gcThread;
+HANDLE gcWake;
+HANDLE gcStopEvent;
+volatile LONG gcInFlight;
+volatile LONG gcRequestSeq;
+volatile ULONGLONG gcLastRequestEnd;
+// python 3.5 keeps its gc counters private, so the request path asks for them at most once an interval.
+ULONGLONG gcNextCheck;
+LARGE_INTEGER gcFrequency;
+
+// gen0 count right after the last idle collection, -1 when allocations happened since.
+long gcIdleCount = -1;
+// collections of the younger generation since the older one was collected.
+long gcSince[2];
+// duration of the last collection of each generation, in microseconds.
+LONG64 gcPause[3];
+
+LONG64 gcCollections[3];
+LONG64 gcPauseTotal[3];
+LONG64 gcPauseMax;
+LONG64 gcForced;
+LONG64 gcForcedTotal;
+
+long gc_get_count0(void) {
+    long result = -1;
+    PyObject *count = PyObject_CallFunctionObjArgs(gcGetCount, NULL);
+    if (count && PyTuple_Check(count) && PyTuple_GET_SIZE(count) > 0)
+        result = PyLong_AsLong(PyTuple_GET_ITEM(count, 0));
+    Py_XDECREF(count);
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        result = -1;
+    }
+    return result;
+}
+
+LONG64 gc_collect(int generation) {
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    PyObject *result = PyObject_CallFunction(gcCollect, "i", generation);
+    QueryPerformanceCounter(&end);
+    if (!result)
+        PyErr_Clear();
+    Py_XDECREF(result);
+    LONG64 pause = (end.QuadPart - start.QuadPart) * 1000000 / gcFrequency.QuadPart;
+    gcPause[generation] = pause;
+    gcCollections[generation]++;
+    gcPauseTotal[generation] += pause;
+    if (pause > gcPauseMax)
+        gcPauseMax = pause;
+    if (generation == 0)
+        gcSince[0]++;
+    else if (generation == 1) {
+        gcSince[0] = 0;
+        gcSince[1]++;
+    }
+    else
+        gcSince[0] = gcSince[1] = 0;
+    return pause;
+}
+
+// returns non-zero when more is due; the GIL is given up between generations.
+int gc_collect_idle(LONG seq) {
+    long count0 = gc_get_count0();
+    if (count0 < 0)
+        return 0;
+    int due = -1;
+    if (gcSince[1] >= gcThreshold[2])
+        due = 2;
+    else if (gcSince[0] >= gcThreshold[1])
+        due = 1;
+    else if (count0 >= gcThreshold[0])
+        due = 0;
+    if (due < 0)
+        return 0;
+    // escalate only as far as the budget allows, unless nothing happened for a while.
+    int generation = due;
+    ULONGLONG idle = GetTickCount64() - gcLastRequestEnd;
+    while (generation > 0 && gcPause[generation] > (LONG64)gcBudget * 1000 && idle < GC_LONG_IDLE)
+        generation--;
+    // held back by the budget, it would be collected again for nothing.
+    if (generation < due && count0 == gcIdleCount)
+        return 0;
+    // the young generation first, so that a request arriving meanwhile cuts in before the older one.
+    if (generation > 0 && count0 >= gcThreshold[0]) {
+        gc_collect(0);
+        gcIdleCount = -1;
+        return 1;
+    }
+    if (seq != gcRequestSeq)
+        return 0;
+    gc_collect(generation);
+    gcIdleCount = gc_get_count0();
+    return generation < due;
+}
+
+DWORD WINAPI gc_main(LPVOID param) {
+    HANDLE handles[2];
+    handles[0] = gcStopEvent;
+    handles[1] = gcWake;
+    while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+        for (;;) {
+            LONG seq = gcRequestSeq;
+            if (WaitForSingleObject(gcStopEvent, gcIdle) == WAIT_OBJECT_0)
+                return 0;
+            // the gap closed; wait for the next one.
+            if (gcInFlight || seq != gcRequestSeq)
+                break;
+            int pending = 0;
+            PyGILState_STATE gil = PyGILState_Ensure();
+            if (gcEnabled && !gcInFlight && seq == gcRequestSeq)
+                pending = gc_collect_idle(seq);
+            PyGILState_Release(gil);
+            // the rest of the gap goes to writing back phiori.store.
+            if (!gcInFlight && seq == gcRequestSeq)
+                store_idle();
+            if (!pending)
+                break;
+        }
+    }
+    return 0;
+}
+
+int LOAD_GC(void) {
+    QueryPerformanceFrequency(&gcFrequency);
+    gcIdle = GC_DEFAULT_IDLE;
+    gcBudget = GC_DEFAULT_BUDGET;
+    gcLimit = GC_DEFAULT_LIMIT;
+    gcLastRequestEnd = GetTickCount64();
+    gcModule = PyImport_ImportModule("gc");
+    if (!gcModule)
+        return 0;
+    gcCollect = PyObject_GetAttrString(gcModule, "collect");
+    gcGetCount = PyObject_GetAttrString(gcModule, "get_count");
+    PyObject *threshold = PyObject_CallMethod(gcModule, "get_threshold", NULL);
+    if (!gcCollect || !gcGetCount || !threshold || !PyArg_ParseTuple(threshold, "lll", &gcThreshold[0], &gcThreshold[1], &gcThreshold[2])) {
+        Py_XDECREF(threshold);
+        return 0;
+    }
+    Py_DECREF(threshold);
+    gcStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    gcWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!gcStopEvent || !gcWake)
+        return 0;
+    gcThread = CreateThread(NULL, 0, gc_main, NULL, 0, NULL);
+    if (!gcThread)
+        return 0;
+    SetThreadPriority(gcThread, THREAD_PRIORITY_BELOW_NORMAL);
+    PyObject *result = PyObject_CallMethod(gcModule, "disable", NULL);
+    Py_XDECREF(result);
+    gcEnabled = result != NULL;
+    return gcEnabled;
+}
+
+int UNLOAD_GC(void) {
+    if (gcThread) {
+        SetEvent(gcStopEvent);
+        WaitForSingleObject(gcThread, INFINITE);
+        CloseHandle(gcThread);
+        gcThread = NULL;
+    }
+    if (gcStopEvent) {
+        CloseHandle(gcStopEvent);
+        gcStopEvent = NULL;
+    }
+    if (gcWake) {
+        CloseHandle(gcWake);
+        gcWake = NULL;
+    }
+    if (gcModule) {
+        // hand collection back to python for unload() and finalisation.
+        PyGILState_STATE gil = PyGILState_Ensure();
+        PyObject *result = PyObject_CallMethod(gcModule, "enable", NULL);
+        if (!result)
+            PyErr_Clear();
+        Py_XDECREF(result);
+        Py_CLEAR(gcGetCount);
+        Py_CLEAR(gcCollect);
+        Py_CLEAR(gcModule);
+        PyGILState_Release(gil);
+    }
+    gcEnabled = 0;
+    return 1;
+}
+
+void gc_request_enter(void) {
+    InterlockedIncrement(&gcRequestSeq);
+}
+
+void gc_request_begin(void) {
+    gcInFlight = 1;
+    // safety valve: don't let garbage pile up when the ghost is never idle.
+    ULONGLONG now = GetTickCount64();
+    if (gcEnabled && now >= gcNextCheck) {
+        gcNextCheck = now + gcIdle;
+        if (gc_get_count0() > gcLimit) {
+            gcIdleCount = -1;
+            gcForced++;
+            gcForcedTotal += gc_collect(0);
+        }
+    }
+}
+
+void gc_request_end(void) {
+    gcLastRequestEnd = GetTickCount64();
+    gcInFlight = 0;
+    if (gcWake)
+        SetEvent(gcWake);
+}
+
+void gc_stats(PyObject *dict) {
+    PyObject *stats = Py_BuildValue("{s:i,s:(LLL),s:(LLL),s:L,s:L,s:L}",
+        "scheduled", gcEnabled,
+        "collections", (long long)gcCollections[0], (long long)gcCollections[1], (long long)gcCollections[2],
+        "pause_us", (long long)gcPauseTotal[0], (long long)gcPauseTotal[1], (long long)gcPauseTotal[2],
+        "max_pause_us", (long long)gcPauseMax,
+        "forced", (long long)gcForced,
+        "forced_us", (long long)gcForcedTotal);
+    if (stats) {
+        PyDict_SetItemString(dict, "gc", stats);
+        Py_DECREF(stats);
+    }
+}
+
+PyObject *phiori_gc_schedule(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"enabled", "idle", "budget", "limit", NULL};
+    PyObject *enabled = Py_None;
+    long idle = -1, budget = -1, limit = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Olll", keywords, &enabled, &idle, &budget, &limit))
+        return NULL;
+    if (!gcModule) {
+        PyErr_SetString(PyExc_RuntimeError, "gc scheduling is not available");
+        return NULL;
+    }
+    if (idle >= 0)
+        gcIdle = (DWORD)idle;
+    if (budget >= 0)
+        gcBudget = (DWORD)budget;
+    if (limit >= 0)
+        gcLimit = limit;
+    if (enabled != Py_None) {
+        int enable = PyObject_IsTrue(enabled);
+        if (enable < 0)
+            return NULL;
+        // scheduling replaces python's automatic collection and vice versa.
+        PyObject *result = PyObject_CallMethod(gcModule, enable ? "disable" : "enable", NULL);
+        if (!result)
+            return NULL;
+        Py_DECREF(result);
+        gcEnabled = enable;
+    }
+    return Py_BuildValue("{s:O,s:k,s:k,s:l}",
+        "enabled", gcEnabled ? Py_True : Py_False,
+        "idle", gcIdle,
+        "budget", gcBudget,
+        "limit", gcLimit);
+}
@@ -0,0 +1,22 @@
+#ifndef _PHIORI_GCSCHED
+#define _PHIORI_GCSCHED 1
+#include <Python.h>
+
+#define GC_DEFAULT_IDLE 100
+#define GC_DEFAULT_BUDGET 5
+#define GC_LONG_IDLE 2000
+#define GC_DEFAULT_LIMIT 10000
+
+// called with the GIL held.
+int LOAD_GC(void);
+// called without the GIL.
+int UNLOAD_GC(void);
+// called without the GIL as soon as a request arrives, so that no collection starts ahead of it.
+void gc_request_enter(void);
+void gc_request_begin(void);
+void gc_request_end(void);
+void gc_stats(PyObject *dict);
+
+PyObject *phiori_gc_schedule(PyObject *self, PyObject *args, PyObject *kwargs);
+
+#endif
@@ -0,0 +1,471 @@
+#include "log.h"
+#include "module.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <Windows.h>
+#include <Python.h>
+
+#define LOG_SLOT_TEXT 112
+// longer messages are split over several records.
+#define LOG_MESSAGE_SLOTS 32
+#define LOG_MESSAGE_MAX (LOG_MESSAGE_SLOTS * LOG_SLOT_TEXT)
+#define LOG_ROTATE_SUFFIX_MAX 16
+
+/*
+ * Bounded multi-producer queue after Vyukov. A writer claims consecutive
+ * slots by moving logHead forward and publishes each slot by setting its
+ * seq to position + 1; the flusher thread is the only reader and frees a
+ * slot for the next lap by setting seq to position + LOG_SLOTS. A writer
+ * never waits: if the flusher is a lap behind, the message is dropped.
+ */
+
+typedef struct _LOG_SLOT {
+    volatile LONG seq;
+    unsigned short len;
+    // slots of the message, on its first slot.
+    unsigned char count;
+    unsigned char tag;
+    ULONGLONG time;
+    char text[LOG_SLOT_TEXT];
+} LOG_SLOT;
+
+typedef struct _LogWriterObject {
+    PyObject_HEAD
+    int tag;
+    // text after the last newline.
+    char *partial;
+    size_t partial_len;
+    size_t partial_capacity;
+} LogWriterObject;
+
+const char *LOG_TAG_NAMES[] = {"phiori", "log", "stdout", "stderr"};
+
+LOG_SLOT logSlots[LOG_SLOTS];
+volatile LONG logHead;
+volatile LONG logTail;
+volatile LONG logReady;
+wchar_t *logPath;
+HANDLE logFile;
+LONG64 logFileSize;
+HANDLE logThread;
+HANDLE logWake;
+HANDLE logStopEvent;
+char *logBatch;
+size_t logBatchCapacity;
+LARGE_INTEGER logFrequency;
+
+volatile LONG64 logRecords;
+volatile LONG64 logDropped;
+volatile LONG64 logWriteTicks;
+volatile LONG64 logWriteMaxTicks;
+LONG64 logBytes;
+LONG64 logFlushes;
+LONG64 logRotations;
+
+int log_enqueue(int tag, ULONGLONG time, const char *text, size_t len) {
+    unsigned long count = len ? (unsigned long)((len + LOG_SLOT_TEXT - 1) / LOG_SLOT_TEXT) : 1;
+    unsigned long pos;
+    for (;;) {
+        pos = (unsigned long)logHead;
+        // the flusher frees slots in order, so the last one being free for this lap is enough.
+        LONG diff = (LONG)((unsigned long)logSlots[(pos + count - 1) & (LOG_SLOTS - 1)].seq - (pos + count - 1));
+        if (diff < 0)
+            return 0;
+        if (diff == 0 && (unsigned long)InterlockedCompareExchange(&logHead, (LONG)(pos + count), (LONG)pos) == pos)
+            break;
+    }
+    // publish the first slot last; the flusher only looks at that one.
+    for (unsigned long i = count; i-- > 0;) {
+        LOG_SLOT *slot = &logSlots[(pos + i) & (LOG_SLOTS - 1)];
+        size_t offset = i * LOG_SLOT_TEXT;
+        size_t slot_len = len - offset < LOG_SLOT_TEXT ? len - offset : LOG_SLOT_TEXT;
+        memcpy(slot->text, text + offset, slot_len);
+        slot->len = (unsigned short)slot_len;
+        slot->count = (unsigned char)(i ? 0 : count);
+        slot->tag = (unsigned char)tag;
+        slot->time = time;
+        InterlockedExchange(&slot->seq, (LONG)(pos + i + 1));
+    }
+    if (pos + count - (unsigned long)logTail >= LOG_SLOTS / 2)
+        SetEvent(logWake);
+    return 1;
+}
+
+int log_write(int tag, const char *text, size_t len) {
+    if (!logReady)
+        return 0;
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    ULONGLONG time = (ULONGLONG)now.dwHighDateTime << 32 | now.dwLowDateTime;
+    int result = 1;
+    do {
+        size_t chunk = len < LOG_MESSAGE_MAX ? len : LOG_MESSAGE_MAX;
+        if (!log_enqueue(tag, time, text, chunk)) {
+            InterlockedIncrement64(&logDropped);
+            result = 0;
+            break;
+        }
+        InterlockedIncrement64(&logRecords);
+        text += chunk;
+        len -= chunk;
+    } while (len);
+    QueryPerformanceCounter(&end);
+    LONG64 ticks = end.QuadPart - start.QuadPart;
+    InterlockedExchangeAdd64(&logWriteTicks, ticks);
+    LONG64 max = logWriteMaxTicks;
+    while (ticks > max) {
+        LONG64 previous = InterlockedCompareExchange64(&logWriteMaxTicks, ticks, max);
+        if (previous == max)
+            break;
+        max = previous;
+    }
+    return result;
+}
+
+int log_print(int tag, const char *text) {
+    return log_write(tag, text, strlen(text));
+}
+
+int log_object(int tag, PyObject *text) {
+    Py_ssize_t len;
+    const char *s = text ? PyUnicode_AsUTF8AndSize(text, &len) : NULL;
+    if (!s) {
+        PyErr_Clear();
+        return 0;
+    }
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r'))
+        len--;
+    return log_write(tag, s, len);
+}
+
+int log_batch_reserve(size_t len, size_t need) {
+    if (len + need <= logBatchCapacity)
+        return 1;
+    size_t capacity = (len + need) * 2;
+    char *batch = realloc(logBatch, capacity);
+    if (!batch)
+        return 0;
+    logBatch = batch;
+    logBatchCapacity = capacity;
+    return 1;
+}
+
+// moves published records into logBatch as lines.
+size_t log_drain(void) {
+    size_t len = 0;
+    for (;;) {
+        unsigned long pos = (unsigned long)logTail;
+        LOG_SLOT *slot = &logSlots[pos & (LOG_SLOTS - 1)];
+        if ((unsigned long)slot->seq != pos + 1)
+            break;
+        unsigned long count = slot->count;
+        if (log_batch_reserve(len, count * LOG_SLOT_TEXT + 64)) {
+            FILETIME time;
+            SYSTEMTIME utc, local;
+            time.dwLowDateTime = (DWORD)slot->time;
+            time.dwHighDateTime = (DWORD)(slot->time >> 32);
+            FileTimeToSystemTime(&time, &utc);
+            if (!SystemTimeToTzSpecificLocalTime(NULL, &utc, &local))
+                local = utc;
+            len += sprintf(logBatch + len, "%04d-%02d-%02d %02d:%02d:%02d.%03d [%s] ",
+                local.wYear, local.wMonth, local.wDay, local.wHour, local.wMinute, local.wSecond, local.wMilliseconds,
+                slot->tag < sizeof(LOG_TAG_NAMES) / sizeof(*LOG_TAG_NAMES) ? LOG_TAG_NAMES[slot->tag] : "?");
+            for (unsigned long i = 0; i < count; i++) {
+                LOG_SLOT *part = &logSlots[(pos + i) & (LOG_SLOTS - 1)];
+                memcpy(logBatch + len, part->text, part->len);
+                len += part->len;
+            }
+            memcpy(logBatch + len, "\r\n", 2);
+            len += 2;
+        }
+        for (unsigned long i = 0; i < count; i++)
+            InterlockedExchange(&logSlots[(pos + i) & (LOG_SLOTS - 1)].seq, (LONG)(pos + i + LOG_SLOTS));
+        InterlockedExchange(&logTail, (LONG)(pos + count));
+    }
+    return len;
+}
+
+void log_open(void) {
+    logFile = CreateFileW(logPath, FILE_APPEND_DATA | FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (logFile == INVALID_HANDLE_VALUE) {
+        logFile = NULL;
+        return;
+    }
+    LARGE_INTEGER size;
+    logFileSize = GetFileSizeEx(logFile, &size) ? size.QuadPart : 0;
+}
+
+// phiori.log -> phiori.log.1 -> ... -> phiori.log.LOG_ROTATE_COUNT
+void log_rotate(void) {
+    size_t path_len = wcslen(logPath) + LOG_ROTATE_SUFFIX_MAX;
+    wchar_t *from = calloc(path_len, sizeof(wchar_t));
+    wchar_t *to = calloc(path_len, sizeof(wchar_t));
+    if (from && to) {
+        CloseHandle(logFile);
+        for (int i = LOG_ROTATE_COUNT; i > 0; i--) {
+            swprintf(to, path_len, L"%ls.%d", logPath, i);
+            if (i > 1)
+                swprintf(from, path_len, L"%ls.%d", logPath, i - 1);
+            else
+                wcscpy(from, logPath);
+            MoveFileExW(from, to, MOVEFILE_REPLACE_EXISTING);
+        }
+        log_open();
+        logRotations++;
+    }
+    free(to);
+    free(from);
+}
+
+void log_flush(void) {
+    size_t len = log_drain();
+    if (!len)
+        return;
+    logFlushes++;
+    if (logFile && logFileSize > 0 && logFileSize + (LONG64)len > LOG_ROTATE_SIZE)
+        log_rotate();
+    DWORD written;
+    if (logFile && WriteFile(logFile, logBatch, (DWORD)len, &written, NULL)) {
+        logFileSize += written;
+        logBytes += written;
+    }
+}
+
+DWORD WINAPI log_main(LPVOID param) {
+    HANDLE handles[2];
+    handles[0] = logStopEvent;
+    handles[1] = logWake;
+    for (;;) {
+        DWORD wait = WaitForMultipleObjects(2, handles, FALSE, LOG_FLUSH_INTERVAL);
+        log_flush();
+        if (wait == WAIT_OBJECT_0 || wait == WAIT_FAILED)
+            return 0;
+    }
+}
+
+int LOAD_Log(const wchar_t *rootW) {
+    QueryPerformanceFrequency(&logFrequency);
+    for (LONG i = 0; i < LOG_SLOTS; i++)
+        logSlots[i].seq = i;
+    logHead = logTail = 0;
+    logPath = calloc(wcslen(rootW) + wcslen(LOG_FILE_NAME_W) + 1, sizeof(wchar_t));
+    if (!logPath)
+        return 0;
+    wcscpy(logPath, rootW);
+    wcscat(logPath, LOG_FILE_NAME_W);
+    // without a file the records are still drained, just not kept.
+    log_open();
+    logStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    logWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!logStopEvent || !logWake)
+        return 0;
+    logThread = CreateThread(NULL, 0, log_main, NULL, 0, NULL);
+    if (!logThread)
+        return 0;
+    SetThreadPriority(logThread, THREAD_PRIORITY_BELOW_NORMAL);
+    logReady = 1;
+    return 1;
+}
+
+int UNLOAD_Log(void) {
+    logReady = 0;
+    if (logThread) {
+        // the flusher drains what is left before it exits.
+        SetEvent(logStopEvent);
+        WaitForSingleObject(logThread, INFINITE);
+        CloseHandle(logThread);
+        logThread = NULL;
+    }
+    if (logStopEvent) {
+        CloseHandle(logStopEvent);
+        logStopEvent = NULL;
+    }
+    if (logWake) {
+        CloseHandle(logWake);
+        logWake = NULL;
+    }
+    if (logFile) {
+        CloseHandle(logFile);
+        logFile = NULL;
+    }
+    free(logBatch);
+    logBatch = NULL;
+    logBatchCapacity = 0;
+    free(logPath);
+    logPath = NULL;
+    return 1;
+}
+
+void log_stats(PyObject *dict) {
+    double ns = logFrequency.QuadPart ? 1e9 / logFrequency.QuadPart : 0;
+    PyObject *stats = Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:d,s:d}",
+        "records", (long long)logRecords,
+        "dropped", (long long)logDropped,
+        "bytes", (long long)logBytes,
+        "flushes", (long long)logFlushes,
+        "rotations", (long long)logRotations,
+        "write_ns", logWriteTicks * ns,
+        "max_write_ns", logWriteMaxTicks * ns);
+    if (stats) {
+        PyDict_SetItemString(dict, "log", stats);
+        Py_DECREF(stats);
+    }
+}
+
+void log_writer_emit(LogWriterObject *self, const char *text, size_t len) {
+    if (len > 0 && text[len - 1] == '\r')
+        len--;
+    log_write(self->tag, text, len);
+}
+
+int log_writer_keep(LogWriterObject *self, const char *text, size_t len) {
+    if (self->partial_len + len > self->partial_capacity) {
+        size_t capacity = (self->partial_len + len) * 2;
+        char *partial = realloc(self->partial, capacity);
+        if (!partial)
+            return 0;
+        self->partial = partial;
+        self->partial_capacity = capacity;
+    }
+    memcpy(self->partial + self->partial_len, text, len);
+    self->partial_len += len;
+    // don't hold on to a line which never ends.
+    if (self->partial_len >= LOG_MESSAGE_MAX) {
+        log_writer_emit(self, self->partial, self->partial_len);
+        self->partial_len = 0;
+    }
+    return 1;
+}
+
+PyObject *log_writer_write(LogWriterObject *self, PyObject *args) {
+    PyObject *text;
+    if (!PyArg_ParseTuple(args, "U:write", &text))
+        return NULL;
+    Py_ssize_t len;
+    const char *s = PyUnicode_AsUTF8AndSize(text, &len);
+    if (!s)
+        return NULL;
+    const char *line = s;
+    const char *end = s + len;
+    for (const char *eol = memchr(line, '\n', end - line); eol; eol = memchr(line, '\n', end - line)) {
+        if (self->partial_len) {
+            if (!log_writer_keep(self, line, eol - line))
+                return PyErr_NoMemory();
+            log_writer_emit(self, self->partial, self->partial_len);
+            self->partial_len = 0;
+        }
+        else
+            log_writer_emit(self, line, eol - line);
+        line = eol + 1;
+    }
+    if (line < end && !log_writer_keep(self, line, end - line))
+        return PyErr_NoMemory();
+    return PyLong_FromSsize_t(PyUnicode_GET_LENGTH(text));
+}
+
+PyObject *log_writer_flush(LogWriterObject *self, PyObject *args) {
+    if (self->partial_len) {
+        log_writer_emit(self, self->partial, self->partial_len);
+        self->partial_len = 0;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *log_writer_writable(LogWriterObject *self, PyObject *args) {
+    Py_RETURN_TRUE;
+}
+
+PyObject *log_writer_isatty(LogWriterObject *self, PyObject *args) {
+    Py_RETURN_FALSE;
+}
+
+PyObject *log_writer_get_encoding(LogWriterObject *self, void *closure) {
+    return PyUnicode_FromString("utf-8");
+}
+
+void log_writer_dealloc(LogWriterObject *self) {
+    free(self->partial);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyMethodDef phioriLogWriterMethods[] = {
+    {"write", (PyCFunction)log_writer_write, METH_VARARGS, NULL},
+    {"flush", (PyCFunction)log_writer_flush, METH_NOARGS, NULL},
+    {"writable", (PyCFunction)log_writer_writable, METH_NOARGS, NULL},
+    {"isatty", (PyCFunction)log_writer_isatty, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+PyGetSetDef phioriLogWriterGetSet[] = {
+    {"encoding", (getter)log_writer_get_encoding, NULL, NULL, NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyTypeObject phioriLogWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = PHIORI_MODULE_NAME ".LogWriter",
+    .tp_basicsize = sizeof(LogWriterObject),
+    .tp_dealloc = (destructor)log_writer_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Text stream writing each line to phiori.log through the log buffer.",
+    .tp_methods = phioriLogWriterMethods,
+    .tp_getset = phioriLogWriterGetSet
+};
+
+PyObject *log_writer_new(int tag) {
+    LogWriterObject *writer = (LogWriterObject *)PyType_GenericAlloc(&phioriLogWriterType, 0);
+    if (writer)
+        writer->tag = tag;
+    return (PyObject *)writer;
+}
+
+int log_redirect(void) {
+    if (PyType_Ready(&phioriLogWriterType) < 0)
+        return 0;
+    PyObject *out = log_writer_new(LOG_STDOUT);
+    PyObject *err = log_writer_new(LOG_STDERR);
+    int result = out && err && PySys_SetObject("stdout", out) == 0 && PySys_SetObject("stderr", err) == 0;
+    Py_XDECREF(err);
+    Py_XDECREF(out);
+    return result;
+}
+
+PyObject *phiori_log(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"sep", NULL};
+    PyObject *sep = NULL;
+    PyObject *empty = PyTuple_New(0);
+    if (!empty)
+        return NULL;
+    int parsed = PyArg_ParseTupleAndKeywords(empty, kwargs, "|U:log", keywords, &sep);
+    Py_DECREF(empty);
+    if (!parsed)
+        return NULL;
+    Py_ssize_t count = PyTuple_GET_SIZE(args);
+    PyObject *values = PyTuple_New(count);
+    if (!values)
+        return NULL;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject *value = PyObject_Str(PyTuple_GET_ITEM(args, i));
+        if (!value) {
+            Py_DECREF(values);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(values, i, value);
+    }
+    PyObject *space = sep ? NULL : PyUnicode_FromString(" ");
+    PyObject *text = sep || space ? PyUnicode_Join(sep ? sep : space, values) : NULL;
+    Py_XDECREF(space);
+    Py_DECREF(values);
+    if (!text)
+        return NULL;
+    Py_ssize_t len;
+    const char *s = PyUnicode_AsUTF8AndSize(text, &len);
+    PyObject *result = s ? PyBool_FromLong(log_write(LOG_GHOST, s, len)) : NULL;
+    Py_DECREF(text);
+    return result;
+}
@@ -0,0 +1,33 @@
+#ifndef _PHIORI_LOG
+#define _PHIORI_LOG 1
+#include <stddef.h>
+#include <wchar.h>
+#include <Python.h>
+
+#define LOG_PHIORI 0
+#define LOG_GHOST 1
+#define LOG_STDOUT 2
+#define LOG_STDERR 3
+
+#define LOG_FILE_NAME_W L"phiori.log"
+// slots of the ring buffer; a power of two.
+#define LOG_SLOTS 4096
+#define LOG_FLUSH_INTERVAL 200
+#define LOG_ROTATE_SIZE (1024 * 1024)
+#define LOG_ROTATE_COUNT 3
+
+int LOAD_Log(const wchar_t *rootW);
+// drains the buffer; safe to call more than once.
+int UNLOAD_Log(void);
+// called with the GIL held; points sys.stdout and sys.stderr at the log.
+int log_redirect(void);
+// never blocks; returns zero when the message was dropped.
+int log_write(int tag, const char *text, size_t len);
+int log_print(int tag, const char *text);
+// writes a str without its trailing newline; clears any error.
+int log_object(int tag, PyObject *text);
+void log_stats(PyObject *dict);
+
+PyObject *phiori_log(PyObject *self, PyObject *args, PyObject *kwargs);
+
+#endif
@@ -0,0 +1,61 @@
+#include "message.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ID_STRING "ID"
+#define EVENT_STRING "Event"
+
+const char *message_get(const char *raw, size_t len, const char *key, size_t *value_len) {
+    size_t key_len = strlen(key);
+    size_t i = 0;
+    // skip request line.
+    while (i < len && raw[i] != '\n')
+        i++;
+    i++;
+    while (i < len) {
+        size_t line = i;
+        size_t eol = i;
+        while (eol < len && raw[eol] != '\n')
+            eol++;
+        size_t line_end = eol;
+        if (line_end > line && raw[line_end - 1] == '\r')
+            line_end--;
+        // empty line terminates headers.
+        if (line_end == line)
+            break;
+        if (line_end - line > key_len && raw[line + key_len] == ':' && memcmp(raw + line, key, key_len) == 0) {
+            size_t p = line + key_len + 1;
+            while (p < line_end && raw[p] == ' ')
+                p++;
+            *value_len = line_end - p;
+            return raw + p;
+        }
+        i = eol + 1;
+    }
+    *value_len = 0;
+    return NULL;
+}
+
+int message_is_shiori3(const char *raw, size_t len) {
+    size_t magic_len = sizeof(SHIORI3_VERSION_MAGIC) - 1;
+    for (size_t i = 0; i + magic_len <= len && raw[i] != '\r' && raw[i] != '\n'; i++)
+        if (memcmp(raw + i, SHIORI3_VERSION_MAGIC, magic_len) == 0)
+            return 1;
+    return 0;
+}
+
+const char *message_get_event(const char *raw, size_t len, size_t *event_len) {
+    return message_get(raw, len, message_is_shiori3(raw, len) ? ID_STRING : EVENT_STRING, event_len);
+}
+
+char *message_build_status(const char *raw, size_t len, const char *stat, long *res_len) {
+    const char *ver = message_is_shiori3(raw, len) ? SHIORI30_VERSION_STRING : SHIORI25_VERSION_STRING;
+    size_t resraw_len = strlen(ver) + strlen(stat) + 6;
+    char *resraw = malloc(resraw_len);
+    if (!resraw)
+        return NULL;
+    sprintf(resraw, "%s %s\r\n\r\n", ver, stat);
+    *res_len = (long)(resraw_len - 1);
+    return resraw;
+}
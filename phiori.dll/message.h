@@ -0,0 +1,22 @@
+#ifndef _PHIORI_MESSAGE
+#define _PHIORI_MESSAGE 1
+#include <stddef.h>
+
+#define SHIORI2_VERSION_MAGIC "SHIORI/2"
+#define SHIORI3_VERSION_MAGIC "SHIORI/3"
+#define SHIORI25_VERSION_STRING SHIORI2_VERSION_MAGIC ".5"
+#define SHIORI30_VERSION_STRING SHIORI3_VERSION_MAGIC ".0"
+#define SHIORI_200 "200 OK"
+#define SHIORI_204 "204 No Content"
+#define SHIORI_400 "400 Bad Request"
+#define SHIORI_500 "500 Internal Server Error"
+
+// scans a raw (not null-terminated) request for a header without copying it.
+const char *message_get(const char *raw, size_t len, const char *key, size_t *value_len);
+// "ID" on SHIORI/3, "Event" on SHIORI/2.
+const char *message_get_event(const char *raw, size_t len, size_t *event_len);
+int message_is_shiori3(const char *raw, size_t len);
+// builds a header-less response matching the request version, for free().
+char *message_build_status(const char *raw, size_t len, const char *stat, long *res_len);
+
+#endif
@@ -0,0 +1,132 @@
+#include "coalesce.h"
+#include "dictionary.h"
+#include "filter.h"
+#include "gcsched.h"
+#include "log.h"
+#include "module.h"
+#include "offload.h"
+#include "phiori.h"
+#include "plugin.h"
+#include "profiler.h"
+#include "store.h"
+#include "template.h"
+#include "watchdog.h"
+#include <stdio.h>
+#include <Python.h>
+
+PyObject *phiori_stats(PyObject *self, PyObject *args) {
+    PyObject *result = PyDict_New();
+    if (!result)
+        return NULL;
+    filter_stats(result);
+    coalesce_stats(result);
+    watchdog_stats(result);
+    gc_stats(result);
+    plugin_stats(result);
+    store_stats(result);
+    log_stats(result);
+    template_stats(result);
+    dictionary_stats(result);
+    offload_stats(result);
+    if (PyErr_Occurred()) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+PyMethodDef phioriMethods[] = {
+    {"subscribe", phiori_subscribe, METH_VARARGS,
+        "subscribe(*ids)\n\nHandle only the given On* event ids in python; other On* events are answered with 204\n"
+        "natively. Resource requests such as version and name always reach python."},
+    {"unsubscribe", phiori_unsubscribe, METH_VARARGS,
+        "unsubscribe(*ids)\n\nStop handling the given event ids in python. Once none are left, every event is\n"
+        "passed to python again."},
+    {"subscriptions", phiori_subscriptions, METH_NOARGS,
+        "subscriptions() -> set or None\n\nSubscribed event ids, or None when every event is passed to python."},
+    {"clear_subscriptions", phiori_clear_subscriptions, METH_NOARGS,
+        "clear_subscriptions()\n\nPass every event to python again."},
+    {"coalesce", phiori_coalesce, METH_VARARGS,
+        "coalesce(id, window)\n\nAbsorb repeats of an event on the same target within window milliseconds.\n"
+        "The next forwarded event of the same id on the same target carries X-Phiori-Coalesced and\n"
+        "X-Phiori-Delta* headers, even when other events came between. The last events of a burst are\n"
+        "not delivered on their own; if the next event is on another target they are dropped and counted\n"
+        "in stats()['coalesce']['dropped']. 0 disables."},
+    {"deadline", phiori_deadline, METH_VARARGS,
+        "deadline(id, budget)\n\nTime budget of an event in milliseconds; id None sets the default. 0 disables.\n"
+        "A handler overrunning it gets RequestTimeout raised and the emergency response is returned."},
+    {"gc_schedule", (PyCFunction)phiori_gc_schedule, METH_VARARGS | METH_KEYWORDS,
+        "gc_schedule(enabled=None, idle=None, budget=None, limit=None) -> dict\n\n"
+        "Configure cyclic gc scheduling: collect after idle milliseconds without requests, escalating to older\n"
+        "generations while their last pause fits in budget milliseconds. A request finding more than limit\n"
+        "young objects collects them first. enabled=False hands collection back to python."},
+    {"profile", (PyCFunction)phiori_profile, METH_VARARGS | METH_KEYWORDS,
+        "profile(count=10, event=None, mode='trace', interval=10, path='phiori.profile')\n\n"
+        "Profile the next count requests (of event only, if given) with a setprofile hook ('trace') or by\n"
+        "sampling every interval milliseconds ('sample'). Collapsed stacks go to path.folded and per-function\n"
+        "times by event to path.tsv. A negative count profiles until profile(0) stops it.\n"
+        "The reserved id " PROFILER_RESERVED_ID " does the same with Reference0-3."},
+    {"plugins", phiori_plugins, METH_NOARGS,
+        "plugins() -> dict\n\nEvent ids served by native plugins, mapped to the plugin file name."},
+    {"log", (PyCFunction)phiori_log, METH_VARARGS | METH_KEYWORDS,
+        "log(*values, sep=' ') -> bool\n\nWrite a line to phiori.log without waiting for the disk, as print() does for\n"
+        "sys.stdout and sys.stderr. False if the buffer was full and the line was dropped."},
+    {"compile_dictionary", phiori_compile_dictionary, METH_VARARGS,
+        "compile_dictionary(source, target)\n\nCompile a utf-8 text dictionary of [key] sections into a file for Dictionary().\n"
+        "Named phiori.dic in the ghost's directory, it is opened at load as phiori.dictionary."},
+    {"offload", (PyCFunction)phiori_offload, METH_VARARGS | METH_KEYWORDS,
+        "offload(func, *args, **kwargs) -> Future\n\nCall func(*args, **kwargs) in a worker process with a python of its own, away from\n"
+        "the GIL of requests. func and the arguments are pickled, so func has to be importable by name.\n"
+        "The call runs whether or not the future is kept; only cancel() stops it, killing its worker if it started.\n"
+        "Workers import phiori with the native names on it, but phiori.store is open only in the baseware."},
+    {"offload_workers", phiori_offload_workers, METH_VARARGS,
+        "offload_workers(count=None) -> int\n\nThe number of worker processes, setting it to count (1-16) first if given."},
+    {"stats", phiori_stats, METH_NOARGS,
+        "stats() -> dict\n\nCounters collected by the native request path."},
+    {NULL, NULL, 0, NULL}
+};
+
+struct PyModuleDef phioriModuleDef = {
+    PyModuleDef_HEAD_INIT,
+    PHIORI_MODULE_NAME,
+    "Native services of phiori.",
+    -1,
+    phioriMethods
+};
+
+PyObject *PyInit__phiori(void) {
+    PyObject *module = PyModule_Create(&phioriModuleDef);
+    if (!module)
+        return NULL;
+    if (!watchdog_init_module(module) || !store_init_module(module) || !template_init_module(module)
+        || !dictionary_init_module(module) || !offload_init_module(module)) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    char version[BUFSIZ];
+    getPhioriVersion(version);
+    PyModule_AddStringConstant(module, "version", version);
+    return module;
+}
+
+int PyModule_ExposePhiori(PyObject *module) {
+    PyObject *native = PyImport_ImportModule(PHIORI_MODULE_NAME);
+    if (!native)
+        return 0;
+    PyObject *dict = PyModule_GetDict(native);
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key) || PyUnicode_READ_CHAR(key, 0) == '_')
+            continue;
+        // the ghost's own definitions win.
+        if (PyObject_HasAttr(module, key))
+            continue;
+        if (PyObject_SetAttr(module, key, value) < 0) {
+            Py_DECREF(native);
+            return 0;
+        }
+    }
+    Py_DECREF(native);
+    return 1;
+}
@@ -0,0 +1,11 @@
+#ifndef _PHIORI_MODULE
+#define _PHIORI_MODULE 1
+#include <Python.h>
+
+#define PHIORI_MODULE_NAME "_phiori"
+
+PyObject *PyInit__phiori(void);
+// copies public names of _phiori onto the ghost's phiori module.
+int PyModule_ExposePhiori(PyObject *module);
+
+#endif
@@ -0,0 +1,977 @@
+#include "dictionary.h"
+#include "module.h"
+#include "offload.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <Windows.h>
+#include <Python.h>
+
+#define OFFLOAD_QUEUED 0
+#define OFFLOAD_RUNNING 1
+#define OFFLOAD_DONE 2
+#define OFFLOAD_CANCELLED 3
+
+// error of a task whose worker went away.
+#define OFFLOAD_LOST 0xFFFFFFFFu
+#define OFFLOAD_UNAVAILABLE_MESSAGE "offload workers are not available"
+// milliseconds between cancelling the reads of threads which do not stop.
+#define OFFLOAD_STOP_INTERVAL 100
+
+/*
+ * A worker is a rundll32 process running OffloadWorker of this dll with an
+ * interpreter of its own, served by a thread here that never takes the GIL.
+ * A task travels as a pickle of (func, args, kwargs) in a section backed
+ * by the page file; the pipes carry only an OFFLOAD_MESSAGE with the handle
+ * of the section and its size. The reply is a pickle of (True, value) or
+ * (False, exception, traceback) in a section of the worker, which the
+ * thread takes over from the worker process.
+ */
+
+typedef struct _OFFLOAD_MESSAGE {
+    uint32_t section;
+    uint32_t size;
+} OFFLOAD_MESSAGE;
+
+typedef struct _OFFLOAD_TASK {
+    volatile LONG refs;
+    int state;
+    // set when the task is done or cancelled.
+    HANDLE done;
+    // the request, then the reply.
+    HANDLE section;
+    size_t size;
+    // windows error, or OFFLOAD_LOST.
+    DWORD error;
+    DWORD exit_code;
+    // the worker while the task runs, and whether cancel() is stopping it.
+    struct _OFFLOAD_WORKER *worker;
+    volatile int cancelled;
+    // the future while its callbacks wait; touched only with the GIL.
+    PyObject *future;
+    LARGE_INTEGER submitted;
+    // the queue or the finished list.
+    struct _OFFLOAD_TASK *next;
+} OFFLOAD_TASK;
+
+typedef struct _OFFLOAD_WORKER {
+    size_t index;
+    HANDLE thread;
+    HANDLE process;
+    // our ends of the pipes.
+    HANDLE input;
+    HANDLE output;
+} OFFLOAD_WORKER;
+
+typedef struct _FutureObject {
+    PyObject_HEAD
+    OFFLOAD_TASK *task;
+    PyObject *callbacks;
+    PyObject *value;
+    PyObject *exception;
+} FutureObject;
+
+extern const wchar_t *PYTHON_DLL_NAME_W;
+
+wchar_t *offloadRoot;
+// rundll32 and this dll; NULL inside a worker.
+wchar_t *offloadCommand;
+HANDLE offloadJob;
+SRWLOCK offloadLock = SRWLOCK_INIT;
+CONDITION_VARIABLE offloadWake = CONDITION_VARIABLE_INIT;
+OFFLOAD_TASK *offloadHead;
+OFFLOAD_TASK *offloadTail;
+OFFLOAD_TASK *offloadFinishedHead;
+OFFLOAD_TASK *offloadFinishedTail;
+OFFLOAD_WORKER offloadWorkers[OFFLOAD_MAX_WORKERS];
+size_t offloadCount;
+int offloadStopping;
+LARGE_INTEGER offloadFrequency;
+
+PyObject *offloadDumps;
+PyObject *offloadLoads;
+PyObject *offloadFormatException;
+
+LONG64 offloadSubmitted;
+LONG64 offloadQueued;
+LONG64 offloadCompleted;
+LONG64 offloadFailed;
+LONG64 offloadCancelled;
+LONG64 offloadLost;
+LONG64 offloadWaitTicks;
+LONG64 offloadRunTicks;
+
+PyTypeObject phioriFutureType;
+
+void offload_release(OFFLOAD_TASK *task) {
+    if (InterlockedDecrement(&task->refs))
+        return;
+    if (task->section)
+        CloseHandle(task->section);
+    CloseHandle(task->done);
+    free(task);
+}
+
+// a section of the page file holding a copy of data.
+HANDLE offload_section(const char *data, size_t size) {
+    HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, NULL);
+    if (!section)
+        return NULL;
+    char *view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size);
+    if (!view) {
+        DWORD error = GetLastError();
+        CloseHandle(section);
+        SetLastError(error);
+        return NULL;
+    }
+    memcpy(view, data, size);
+    UnmapViewOfFile(view);
+    return section;
+}
+
+int offload_read(HANDLE pipe, void *buffer, DWORD size) {
+    char *p = buffer;
+    while (size) {
+        DWORD count;
+        if (!ReadFile(pipe, p, size, &count, NULL) || !count)
+            return 0;
+        p += count;
+        size -= count;
+    }
+    return 1;
+}
+
+int offload_write(HANDLE pipe, const OFFLOAD_MESSAGE *message) {
+    DWORD count;
+    return WriteFile(pipe, message, sizeof(OFFLOAD_MESSAGE), &count, NULL) && count == sizeof(OFFLOAD_MESSAGE);
+}
+
+void offload_kill(OFFLOAD_WORKER *worker) {
+    AcquireSRWLockExclusive(&offloadLock);
+    HANDLE process = worker->process;
+    worker->process = NULL;
+    ReleaseSRWLockExclusive(&offloadLock);
+    if (process) {
+        TerminateProcess(process, 1);
+        CloseHandle(process);
+    }
+    if (worker->input) {
+        CloseHandle(worker->input);
+        worker->input = NULL;
+    }
+    if (worker->output) {
+        CloseHandle(worker->output);
+        worker->output = NULL;
+    }
+}
+
+int offload_spawn(OFFLOAD_WORKER *worker) {
+    HANDLE child_input = NULL, child_output = NULL;
+    STARTUPINFOEXW startup;
+    PROCESS_INFORMATION info;
+    memset(&startup, 0, sizeof(startup));
+    startup.StartupInfo.cb = sizeof(startup);
+    memset(&info, 0, sizeof(info));
+    SIZE_T attributes_size = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attributes_size);
+    size_t len = wcslen(offloadCommand) + wcslen(offloadRoot) + 32;
+    wchar_t *command = calloc(len, sizeof(wchar_t));
+    startup.lpAttributeList = malloc(attributes_size);
+    if (!command || !startup.lpAttributeList) {
+        free(command);
+        free(startup.lpAttributeList);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    BOOL attributes = InitializeProcThreadAttributeList(startup.lpAttributeList, 1, 0, &attributes_size);
+    // the worker inherits its two pipe ends and nothing else of the baseware. They are inheritable
+    // only until they are closed below, so that a process the baseware starts meanwhile is
+    // unlikely to pick one up and hold it open after the worker is gone.
+    HANDLE inherited[2];
+    int result = attributes
+        && CreatePipe(&child_input, &worker->input, NULL, 0)
+        && CreatePipe(&worker->output, &child_output, NULL, 0)
+        && SetHandleInformation(child_input, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT)
+        && SetHandleInformation(child_output, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    if (result) {
+        inherited[0] = child_input;
+        inherited[1] = child_output;
+        result = UpdateProcThreadAttribute(startup.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+            inherited, sizeof(inherited), NULL, NULL);
+    }
+    if (result) {
+        // handle values stay the same in the worker, which inherits them.
+        swprintf(command, len, L"%ls %lx %lx %ls", offloadCommand,
+            (unsigned long)(uintptr_t)child_input, (unsigned long)(uintptr_t)child_output, offloadRoot);
+        // below normal, so that workers never compete with the request thread.
+        result = CreateProcessW(NULL, command, NULL, NULL, TRUE,
+            CREATE_SUSPENDED | CREATE_NO_WINDOW | BELOW_NORMAL_PRIORITY_CLASS | EXTENDED_STARTUPINFO_PRESENT,
+            NULL, offloadRoot, &startup.StartupInfo, &info);
+    }
+    DWORD error = GetLastError();
+    if (child_input)
+        CloseHandle(child_input);
+    if (child_output)
+        CloseHandle(child_output);
+    if (attributes)
+        DeleteProcThreadAttributeList(startup.lpAttributeList);
+    free(startup.lpAttributeList);
+    free(command);
+    if (!result) {
+        offload_kill(worker);
+        SetLastError(error);
+        return 0;
+    }
+    // workers go away with this process, however it ends.
+    if (offloadJob)
+        AssignProcessToJobObject(offloadJob, info.hProcess);
+    ResumeThread(info.hThread);
+    CloseHandle(info.hThread);
+    AcquireSRWLockExclusive(&offloadLock);
+    worker->process = info.hProcess;
+    if (offloadStopping)
+        TerminateProcess(info.hProcess, 1);
+    ReleaseSRWLockExclusive(&offloadLock);
+    return 1;
+}
+
+void offload_run(OFFLOAD_WORKER *worker, OFFLOAD_TASK *task) {
+    if (!worker->process && !offload_spawn(worker)) {
+        task->error = GetLastError();
+        return;
+    }
+    // cancelled before there was a process to stop.
+    if (task->cancelled)
+        return;
+    HANDLE remote;
+    if (!DuplicateHandle(GetCurrentProcess(), task->section, worker->process, &remote, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        task->error = GetLastError();
+        return;
+    }
+    OFFLOAD_MESSAGE message;
+    message.section = (uint32_t)(uintptr_t)remote;
+    message.size = (uint32_t)task->size;
+    if (!offload_write(worker->input, &message) || !offload_read(worker->output, &message, sizeof(message))) {
+        task->error = OFFLOAD_LOST;
+        if (WaitForSingleObject(worker->process, 1000) != WAIT_OBJECT_0 || !GetExitCodeProcess(worker->process, &task->exit_code))
+            task->exit_code = STILL_ACTIVE;
+        // the next task starts a new one.
+        offload_kill(worker);
+        return;
+    }
+    HANDLE reply;
+    if (!DuplicateHandle(worker->process, (HANDLE)(uintptr_t)message.section, GetCurrentProcess(), &reply, 0, FALSE,
+        DUPLICATE_SAME_ACCESS | DUPLICATE_CLOSE_SOURCE)) {
+        task->error = GetLastError();
+        // the reply is stranded in the worker; start over with a new one.
+        offload_kill(worker);
+        return;
+    }
+    CloseHandle(task->section);
+    task->section = reply;
+    task->size = message.size;
+}
+
+// called with offloadLock held; returns zero when the reference of the queue is to be released.
+int offload_finish(OFFLOAD_TASK *task, int state) {
+    task->state = state;
+    task->next = NULL;
+    SetEvent(task->done);
+    if (!task->future)
+        return 0;
+    if (offloadFinishedTail)
+        offloadFinishedTail->next = task;
+    else
+        offloadFinishedHead = task;
+    offloadFinishedTail = task;
+    return 1;
+}
+
+DWORD WINAPI offload_main(LPVOID param) {
+    OFFLOAD_WORKER *worker = param;
+    // start python ahead of the first task.
+    if (!worker->process)
+        offload_spawn(worker);
+    AcquireSRWLockExclusive(&offloadLock);
+    for (;;) {
+        while (!offloadStopping && !offloadHead && worker->index < offloadCount)
+            SleepConditionVariableSRW(&offloadWake, &offloadLock, INFINITE, 0);
+        if (offloadStopping || worker->index >= offloadCount)
+            break;
+        OFFLOAD_TASK *task = offloadHead;
+        offloadHead = task->next;
+        if (!offloadHead)
+            offloadTail = NULL;
+        task->state = OFFLOAD_RUNNING;
+        task->worker = worker;
+        offloadQueued--;
+        ReleaseSRWLockExclusive(&offloadLock);
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        offload_run(worker, task);
+        QueryPerformanceCounter(&end);
+        AcquireSRWLockExclusive(&offloadLock);
+        offloadWaitTicks += start.QuadPart - task->submitted.QuadPart;
+        offloadRunTicks += end.QuadPart - start.QuadPart;
+        task->worker = NULL;
+        if (task->cancelled) {
+            offloadCancelled++;
+            if (!offload_finish(task, OFFLOAD_CANCELLED))
+                offload_release(task);
+            // the process may have been stopped after it replied.
+            ReleaseSRWLockExclusive(&offloadLock);
+            offload_kill(worker);
+            AcquireSRWLockExclusive(&offloadLock);
+            continue;
+        }
+        if (task->error == OFFLOAD_LOST)
+            offloadLost++;
+        else if (task->error)
+            offloadFailed++;
+        else
+            offloadCompleted++;
+        if (!offload_finish(task, OFFLOAD_DONE))
+            offload_release(task);
+    }
+    ReleaseSRWLockExclusive(&offloadLock);
+    offload_kill(worker);
+    return 0;
+}
+
+// starts the threads of the pool which are not running; called with the GIL held.
+int offload_start(void) {
+    if (!offloadCommand) {
+        PyErr_SetString(PyExc_RuntimeError, OFFLOAD_UNAVAILABLE_MESSAGE);
+        return 0;
+    }
+    int result = 1;
+    AcquireSRWLockExclusive(&offloadLock);
+    for (size_t i = 0; i < offloadCount; i++) {
+        OFFLOAD_WORKER *worker = &offloadWorkers[i];
+        // one left over from a smaller pool.
+        if (worker->thread && WaitForSingleObject(worker->thread, 0) == WAIT_OBJECT_0) {
+            CloseHandle(worker->thread);
+            worker->thread = NULL;
+        }
+        if (worker->thread)
+            continue;
+        worker->index = i;
+        worker->thread = CreateThread(NULL, 0, offload_main, worker, 0, NULL);
+        if (!worker->thread) {
+            result = 0;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&offloadLock);
+    if (!result)
+        PyErr_SetFromWindowsErr(0);
+    return result;
+}
+
+// takes a queued task off the queue.
+// 1 when the task was taken off the queue, 2 when its worker is being stopped.
+int offload_cancel(OFFLOAD_TASK *task) {
+    int result = 0;
+    AcquireSRWLockExclusive(&offloadLock);
+    if (task->state == OFFLOAD_RUNNING && task->worker && !task->cancelled) {
+        // the pump finishes the task as cancelled once the pipe breaks, and the next task starts a new worker.
+        task->cancelled = 1;
+        if (task->worker->process)
+            TerminateProcess(task->worker->process, 1);
+        CancelSynchronousIo(task->worker->thread);
+        ReleaseSRWLockExclusive(&offloadLock);
+        return 2;
+    }
+    if (task->state == OFFLOAD_QUEUED) {
+        OFFLOAD_TASK **link = &offloadHead, *previous = NULL;
+        while (*link != task) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        *link = task->next;
+        if (offloadTail == task)
+            offloadTail = previous;
+        offloadQueued--;
+        offloadCancelled++;
+        task->state = OFFLOAD_CANCELLED;
+        task->next = NULL;
+        SetEvent(task->done);
+        result = 1;
+    }
+    ReleaseSRWLockExclusive(&offloadLock);
+    if (result)
+        offload_release(task);
+    return result;
+}
+
+int LOAD_Offload(const wchar_t *rootW) {
+    QueryPerformanceFrequency(&offloadFrequency);
+    SYSTEM_INFO system;
+    GetSystemInfo(&system);
+    // one core stays with the request thread.
+    offloadCount = system.dwNumberOfProcessors > 1 ? system.dwNumberOfProcessors - 1 : 1;
+    if (offloadCount > OFFLOAD_DEFAULT_WORKERS)
+        offloadCount = OFFLOAD_DEFAULT_WORKERS;
+    wchar_t directory[MAX_PATH], module[MAX_PATH];
+    HMODULE self;
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)&offloadCount, &self))
+        return 0;
+    DWORD module_len = GetModuleFileNameW(self, module, MAX_PATH);
+    // a 32-bit dll needs the 32-bit rundll32.
+    UINT directory_len = GetSystemWow64DirectoryW(directory, MAX_PATH);
+    if (!directory_len)
+        directory_len = GetSystemDirectoryW(directory, MAX_PATH);
+    if (!module_len || module_len >= MAX_PATH || !directory_len || directory_len >= MAX_PATH)
+        return 0;
+    size_t len = directory_len + module_len + 64;
+    offloadCommand = calloc(len, sizeof(wchar_t));
+    offloadRoot = calloc(wcslen(rootW) + 1, sizeof(wchar_t));
+    if (!offloadCommand || !offloadRoot) {
+        free(offloadCommand);
+        offloadCommand = NULL;
+        return 0;
+    }
+    swprintf(offloadCommand, len, L"\"%ls\\rundll32.exe\" \"%ls\",OffloadWorker", directory, module);
+    wcscpy(offloadRoot, rootW);
+    offloadJob = CreateJobObjectW(NULL, NULL);
+    if (offloadJob) {
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION limit;
+        memset(&limit, 0, sizeof(limit));
+        limit.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+        // workers then only end with UNLOAD, or with a crash of the baseware.
+        if (!SetInformationJobObject(offloadJob, JobObjectExtendedLimitInformation, &limit, sizeof(limit))) {
+            CloseHandle(offloadJob);
+            offloadJob = NULL;
+        }
+    }
+    return 1;
+}
+
+int UNLOAD_Offload(void) {
+    AcquireSRWLockExclusive(&offloadLock);
+    offloadStopping = 1;
+    // ends the reads of threads waiting for a reply.
+    for (size_t i = 0; i < OFFLOAD_MAX_WORKERS; i++)
+        if (offloadWorkers[i].process)
+            TerminateProcess(offloadWorkers[i].process, 1);
+    WakeAllConditionVariable(&offloadWake);
+    ReleaseSRWLockExclusive(&offloadLock);
+    // the threads never take the GIL, so this cannot deadlock. A read can outlive its worker
+    // when another process holds the pipe open, so it is cancelled until the thread is gone.
+    for (size_t i = 0; i < OFFLOAD_MAX_WORKERS; i++)
+        if (offloadWorkers[i].thread) {
+            while (WaitForSingleObject(offloadWorkers[i].thread, OFFLOAD_STOP_INTERVAL) == WAIT_TIMEOUT)
+                CancelSynchronousIo(offloadWorkers[i].thread);
+            CloseHandle(offloadWorkers[i].thread);
+            offloadWorkers[i].thread = NULL;
+        }
+    while (offloadHead) {
+        OFFLOAD_TASK *task = offloadHead;
+        offloadHead = task->next;
+        offloadCancelled++;
+        if (!offload_finish(task, OFFLOAD_CANCELLED))
+            offload_release(task);
+    }
+    offloadTail = NULL;
+    offloadQueued = 0;
+    // callbacks would run in a python which is going away.
+    while (offloadFinishedHead) {
+        OFFLOAD_TASK *task = offloadFinishedHead;
+        offloadFinishedHead = task->next;
+        PyObject *future = task->future;
+        task->future = NULL;
+        Py_DECREF(future);
+        offload_release(task);
+    }
+    offloadFinishedTail = NULL;
+    if (offloadJob) {
+        CloseHandle(offloadJob);
+        offloadJob = NULL;
+    }
+    free(offloadCommand);
+    offloadCommand = NULL;
+    free(offloadRoot);
+    offloadRoot = NULL;
+    offloadStopping = 0;
+    return 1;
+}
+
+void offload_stats(PyObject *dict) {
+    // copied out under the lock; a finalizer run by an allocation below may offload, which takes it.
+    AcquireSRWLockShared(&offloadLock);
+    size_t workers = offloadCount, running = 0;
+    for (size_t i = 0; i < OFFLOAD_MAX_WORKERS; i++)
+        if (offloadWorkers[i].process)
+            running++;
+    LONG64 submitted = offloadSubmitted;
+    LONG64 queued = offloadQueued;
+    LONG64 completed = offloadCompleted;
+    LONG64 failed = offloadFailed;
+    LONG64 cancelled = offloadCancelled;
+    LONG64 lost = offloadLost;
+    LONG64 wait_ticks = offloadWaitTicks;
+    LONG64 run_ticks = offloadRunTicks;
+    ReleaseSRWLockShared(&offloadLock);
+    LONG64 frequency = offloadFrequency.QuadPart ? offloadFrequency.QuadPart : 1;
+    PyObject *stats = Py_BuildValue("{s:n,s:n,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L}",
+        "workers", (Py_ssize_t)workers,
+        "running", (Py_ssize_t)running,
+        "submitted", (long long)submitted,
+        "queued", (long long)queued,
+        "completed", (long long)completed,
+        "failed", (long long)failed,
+        "cancelled", (long long)cancelled,
+        "lost", (long long)lost,
+        "wait_us", (long long)(wait_ticks * 1000000 / frequency),
+        "run_us", (long long)(run_ticks * 1000000 / frequency));
+    if (stats) {
+        PyDict_SetItemString(dict, "offload", stats);
+        Py_DECREF(stats);
+    }
+}
+
+void future_run_callbacks(FutureObject *self) {
+    PyObject *callbacks = self->callbacks;
+    if (!callbacks)
+        return;
+    self->callbacks = NULL;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(callbacks); i++) {
+        PyObject *callback = PyList_GET_ITEM(callbacks, i);
+        PyObject *result = PyObject_CallFunctionObjArgs(callback, (PyObject *)self, NULL);
+        if (!result)
+            PyErr_WriteUnraisable(callback);
+        Py_XDECREF(result);
+    }
+    Py_DECREF(callbacks);
+}
+
+void offload_dispatch(void) {
+    AcquireSRWLockExclusive(&offloadLock);
+    OFFLOAD_TASK *task = offloadFinishedHead;
+    offloadFinishedHead = offloadFinishedTail = NULL;
+    ReleaseSRWLockExclusive(&offloadLock);
+    while (task) {
+        OFFLOAD_TASK *next = task->next;
+        FutureObject *future = (FutureObject *)task->future;
+        task->future = NULL;
+        future_run_callbacks(future);
+        Py_DECREF(future);
+        offload_release(task);
+        task = next;
+    }
+}
+
+// decodes the reply once; zero with an error set when there is none.
+int future_outcome(FutureObject *self) {
+    if (self->value || self->exception)
+        return 1;
+    OFFLOAD_TASK *task = self->task;
+    if (task->state == OFFLOAD_CANCELLED) {
+        PyErr_SetString(PyExc_RuntimeError, "offloaded task was cancelled");
+        return 0;
+    }
+    if (task->error == OFFLOAD_LOST) {
+        PyErr_Format(PyExc_RuntimeError, "offload worker exited with code %lu", (unsigned long)task->exit_code);
+        return 0;
+    }
+    if (task->error) {
+        PyErr_SetFromWindowsErr(task->error);
+        return 0;
+    }
+    char *view = MapViewOfFile(task->section, FILE_MAP_READ, 0, 0, task->size);
+    if (!view) {
+        PyErr_SetFromWindowsErr(0);
+        return 0;
+    }
+    PyObject *buffer = PyMemoryView_FromMemory(view, (Py_ssize_t)task->size, PyBUF_READ);
+    PyObject *reply = buffer ? PyObject_CallFunctionObjArgs(offloadLoads, buffer, NULL) : NULL;
+    Py_XDECREF(buffer);
+    UnmapViewOfFile(view);
+    if (!reply)
+        return 0;
+    PyObject *ok, *value, *traceback = NULL;
+    if (!PyArg_ParseTuple(reply, "OO|O", &ok, &value, &traceback)) {
+        Py_DECREF(reply);
+        return 0;
+    }
+    if (ok == Py_True) {
+        Py_INCREF(value);
+        self->value = value;
+    }
+    else if (PyExceptionInstance_Check(value)) {
+        Py_INCREF(value);
+        self->exception = value;
+        // where it was raised, as the worker saw it.
+        PyObject *cause = traceback ? PyObject_CallFunctionObjArgs(PyExc_RuntimeError, traceback, NULL) : NULL;
+        if (cause)
+            PyException_SetCause(value, cause);
+        PyErr_Clear();
+    }
+    Py_DECREF(reply);
+    if (!self->value && !self->exception) {
+        PyErr_SetString(PyExc_RuntimeError, "malformed reply from offload worker");
+        return 0;
+    }
+    CloseHandle(task->section);
+    task->section = NULL;
+    return 1;
+}
+
+int future_wait(FutureObject *self, PyObject *timeout) {
+    DWORD ms = INFINITE;
+    if (timeout && timeout != Py_None) {
+        long t = PyLong_AsLong(timeout);
+        if (t == -1 && PyErr_Occurred())
+            return 0;
+        ms = t < 0 ? 0 : (DWORD)t;
+    }
+    DWORD wait;
+    Py_BEGIN_ALLOW_THREADS
+    wait = WaitForSingleObject(self->task->done, ms);
+    Py_END_ALLOW_THREADS
+    if (wait != WAIT_OBJECT_0) {
+        PyErr_SetString(PyExc_TimeoutError, "offloaded task is not done");
+        return 0;
+    }
+    return 1;
+}
+
+PyObject *phiori_future_done(FutureObject *self, PyObject *args) {
+    return PyBool_FromLong(WaitForSingleObject(self->task->done, 0) == WAIT_OBJECT_0);
+}
+
+PyObject *phiori_future_cancelled(FutureObject *self, PyObject *args) {
+    return PyBool_FromLong(self->task->state == OFFLOAD_CANCELLED || self->task->cancelled);
+}
+
+PyObject *phiori_future_cancel(FutureObject *self, PyObject *args) {
+    int result = offload_cancel(self->task);
+    if (!result)
+        Py_RETURN_FALSE;
+    // the pump finishes a running task, and its callbacks are dispatched then.
+    if (result == 2)
+        Py_RETURN_TRUE;
+    // no worker will finish it, so its callbacks are due now.
+    AcquireSRWLockExclusive(&offloadLock);
+    PyObject *future = self->task->future;
+    self->task->future = NULL;
+    ReleaseSRWLockExclusive(&offloadLock);
+    future_run_callbacks(self);
+    Py_XDECREF(future);
+    Py_RETURN_TRUE;
+}
+
+PyObject *phiori_future_result(FutureObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"timeout", NULL};
+    PyObject *timeout = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:result", keywords, &timeout))
+        return NULL;
+    if (!future_wait(self, timeout) || !future_outcome(self))
+        return NULL;
+    if (self->exception) {
+        PyErr_SetObject(PyExceptionInstance_Class(self->exception), self->exception);
+        return NULL;
+    }
+    Py_INCREF(self->value);
+    return self->value;
+}
+
+PyObject *phiori_future_exception(FutureObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"timeout", NULL};
+    PyObject *timeout = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:exception", keywords, &timeout))
+        return NULL;
+    if (!future_wait(self, timeout) || !future_outcome(self))
+        return NULL;
+    PyObject *result = self->exception ? self->exception : Py_None;
+    Py_INCREF(result);
+    return result;
+}
+
+PyObject *phiori_future_add_done_callback(FutureObject *self, PyObject *callback) {
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (!self->callbacks) {
+        self->callbacks = PyList_New(0);
+        if (!self->callbacks)
+            return NULL;
+    }
+    if (PyList_Append(self->callbacks, callback) < 0)
+        return NULL;
+    int pending = 0;
+    AcquireSRWLockExclusive(&offloadLock);
+    if (self->task->state < OFFLOAD_DONE) {
+        pending = 1;
+        // kept alive until the next request after the task is done.
+        if (!self->task->future) {
+            Py_INCREF(self);
+            self->task->future = (PyObject *)self;
+        }
+    }
+    ReleaseSRWLockExclusive(&offloadLock);
+    if (!pending)
+        future_run_callbacks(self);
+    Py_RETURN_NONE;
+}
+
+// a callback or the value of a task can refer back to its future.
+int phiori_future_traverse(FutureObject *self, visitproc visit, void *arg) {
+    Py_VISIT(self->callbacks);
+    Py_VISIT(self->value);
+    Py_VISIT(self->exception);
+    return 0;
+}
+
+int phiori_future_clear(FutureObject *self) {
+    Py_CLEAR(self->callbacks);
+    Py_CLEAR(self->value);
+    Py_CLEAR(self->exception);
+    return 0;
+}
+
+void phiori_future_dealloc(FutureObject *self) {
+    PyObject_GC_UnTrack(self);
+    // the queue holds a reference of its own, so a dropped future still runs.
+    if (self->task)
+        offload_release(self->task);
+    phiori_future_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyObject *phiori_offload(PyObject *self, PyObject *args, PyObject *kwargs) {
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "offload() needs a function to call");
+        return NULL;
+    }
+    if (!offload_start())
+        return NULL;
+    PyObject *rest = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    PyObject *call = rest ? PyTuple_Pack(3, PyTuple_GET_ITEM(args, 0), rest, kwargs ? kwargs : Py_None) : NULL;
+    Py_XDECREF(rest);
+    // functions go by name, so they have to be importable in the worker.
+    PyObject *pickled = call ? PyObject_CallFunction(offloadDumps, "Oi", call, OFFLOAD_PICKLE_PROTOCOL) : NULL;
+    Py_XDECREF(call);
+    if (!pickled)
+        return NULL;
+    if (!PyBytes_Check(pickled) || (size_t)PyBytes_GET_SIZE(pickled) > UINT32_MAX) {
+        Py_DECREF(pickled);
+        PyErr_SetString(PyExc_ValueError, "arguments of offload() do not fit in a section");
+        return NULL;
+    }
+    OFFLOAD_TASK *task = calloc(1, sizeof(OFFLOAD_TASK));
+    if (!task) {
+        Py_DECREF(pickled);
+        return PyErr_NoMemory();
+    }
+    task->refs = 1;
+    task->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+    task->size = (size_t)PyBytes_GET_SIZE(pickled);
+    task->section = task->done ? offload_section(PyBytes_AS_STRING(pickled), task->size) : NULL;
+    Py_DECREF(pickled);
+    FutureObject *future = task->section ? (FutureObject *)phioriFutureType.tp_alloc(&phioriFutureType, 0) : NULL;
+    if (!future) {
+        if (!task->section)
+            PyErr_SetFromWindowsErr(0);
+        if (task->done)
+            CloseHandle(task->done);
+        if (task->section)
+            CloseHandle(task->section);
+        free(task);
+        return NULL;
+    }
+    future->task = task;
+    QueryPerformanceCounter(&task->submitted);
+    AcquireSRWLockExclusive(&offloadLock);
+    // one reference for the queue, until a thread is done with it.
+    InterlockedIncrement(&task->refs);
+    if (offloadTail)
+        offloadTail->next = task;
+    else
+        offloadHead = task;
+    offloadTail = task;
+    offloadSubmitted++;
+    offloadQueued++;
+    WakeConditionVariable(&offloadWake);
+    ReleaseSRWLockExclusive(&offloadLock);
+    return (PyObject *)future;
+}
+
+PyObject *phiori_offload_workers(PyObject *self, PyObject *args) {
+    PyObject *count = Py_None;
+    if (!PyArg_ParseTuple(args, "|O:offload_workers", &count))
+        return NULL;
+    if (count != Py_None) {
+        long n = PyLong_AsLong(count);
+        if (n == -1 && PyErr_Occurred())
+            return NULL;
+        if (n < 1 || n > OFFLOAD_MAX_WORKERS) {
+            PyErr_Format(PyExc_ValueError, "offload workers must be between 1 and %d", OFFLOAD_MAX_WORKERS);
+            return NULL;
+        }
+        AcquireSRWLockExclusive(&offloadLock);
+        offloadCount = (size_t)n;
+        // threads past the new count leave when they are idle.
+        WakeAllConditionVariable(&offloadWake);
+        ReleaseSRWLockExclusive(&offloadLock);
+        if (!offload_start())
+            return NULL;
+    }
+    return PyLong_FromSize_t(offloadCount);
+}
+
+// runs the task in message; returns the pickled reply.
+PyObject *offload_execute(const OFFLOAD_MESSAGE *message) {
+    HANDLE section = (HANDLE)(uintptr_t)message->section;
+    char *view = MapViewOfFile(section, FILE_MAP_READ, 0, 0, message->size);
+    if (!view)
+        PyErr_SetFromWindowsErr(0);
+    CloseHandle(section);
+    PyObject *value = NULL;
+    if (view) {
+        PyObject *buffer = PyMemoryView_FromMemory(view, (Py_ssize_t)message->size, PyBUF_READ);
+        PyObject *call = buffer ? PyObject_CallFunctionObjArgs(offloadLoads, buffer, NULL) : NULL;
+        Py_XDECREF(buffer);
+        UnmapViewOfFile(view);
+        PyObject *func, *args, *kwargs;
+        if (call && PyArg_ParseTuple(call, "OO!O", &func, &PyTuple_Type, &args, &kwargs))
+            value = PyObject_Call(func, args, kwargs == Py_None ? NULL : kwargs);
+        Py_XDECREF(call);
+    }
+    PyObject *reply = NULL;
+    if (value) {
+        reply = PyObject_CallFunction(offloadDumps, "(OO)i", Py_True, value, OFFLOAD_PICKLE_PROTOCOL);
+        Py_DECREF(value);
+    }
+    if (reply)
+        return reply;
+    PyObject *type, *exception, *traceback;
+    PyErr_Fetch(&type, &exception, &traceback);
+    PyErr_NormalizeException(&type, &exception, &traceback);
+    if (traceback)
+        PyException_SetTraceback(exception, traceback);
+    PyObject *lines = PyObject_CallFunctionObjArgs(offloadFormatException, type, exception, traceback ? traceback : Py_None, NULL);
+    PyObject *empty = PyUnicode_FromString("");
+    PyObject *text = lines && empty ? PyUnicode_Join(empty, lines) : NULL;
+    Py_XDECREF(empty);
+    Py_XDECREF(lines);
+    if (!text) {
+        PyErr_Clear();
+        text = PyUnicode_FromString("");
+    }
+    reply = PyObject_CallFunction(offloadDumps, "(OOO)i", Py_False, exception, text, OFFLOAD_PICKLE_PROTOCOL);
+    if (!reply) {
+        // an exception which does not pickle comes back as its repr.
+        PyErr_Clear();
+        PyObject *error = PyObject_CallFunction(PyExc_RuntimeError, "N", PyObject_Repr(exception));
+        if (error)
+            reply = PyObject_CallFunction(offloadDumps, "(OOO)i", Py_False, error, text, OFFLOAD_PICKLE_PROTOCOL);
+        Py_XDECREF(error);
+    }
+    Py_XDECREF(text);
+    Py_XDECREF(type);
+    Py_XDECREF(exception);
+    Py_XDECREF(traceback);
+    return reply;
+}
+
+int offload_worker(HANDLE input, HANDLE output, wchar_t *rootW) {
+    wchar_t *path = calloc(wcslen(rootW) + wcslen(PYTHON_DLL_NAME_W) + 1, sizeof(wchar_t));
+    if (!path)
+        return 1;
+    wcscpy(path, rootW);
+    wcscat(path, PYTHON_DLL_NAME_W);
+    // the delayed import finds it loaded already.
+    HMODULE dll = LoadLibraryW(path);
+    free(path);
+    if (!dll)
+        return 1;
+    SetCurrentDirectoryW(rootW);
+    LOAD_Dictionary(rootW);
+    Py_SetProgramName(rootW);
+    Py_SetPythonHome(rootW);
+    PyImport_AppendInittab(PHIORI_MODULE_NAME, PyInit__phiori);
+    Py_Initialize();
+    PyObject *native = PyImport_ImportModule(PHIORI_MODULE_NAME);
+    PyObject *traceback = PyImport_ImportModule("traceback");
+    offloadFormatException = traceback ? PyObject_GetAttrString(traceback, "format_exception") : NULL;
+    if (!native || !offloadDumps || !offloadLoads || !offloadFormatException)
+        return 2;
+    // ghost functions reach the native api through phiori, as they do in the baseware.
+    PyObject *ghost = PyImport_ImportModule("phiori");
+    if (!ghost || !PyModule_ExposePhiori(ghost))
+        PyErr_Clear();
+    Py_XDECREF(ghost);
+    OFFLOAD_MESSAGE message;
+    while (offload_read(input, &message, sizeof(message))) {
+        PyObject *reply = offload_execute(&message);
+        HANDLE section = reply ? offload_section(PyBytes_AS_STRING(reply), (size_t)PyBytes_GET_SIZE(reply)) : NULL;
+        message.size = reply ? (uint32_t)PyBytes_GET_SIZE(reply) : 0;
+        Py_XDECREF(reply);
+        if (!section)
+            return 3;
+        // the parent takes the section over and closes it here.
+        message.section = (uint32_t)(uintptr_t)section;
+        if (!offload_write(output, &message))
+            break;
+    }
+    return 0;
+}
+
+// rundll32 phiori.dll,OffloadWorker input output root, as started by offload_spawn.
+#pragma comment(linker, "/EXPORT:OffloadWorkerW=_OffloadWorkerW@16")
+void CALLBACK OffloadWorkerW(HWND hwnd, HINSTANCE instance, LPWSTR command_line, int show) {
+    wchar_t *rest;
+    HANDLE input = (HANDLE)(uintptr_t)wcstoul(command_line, &rest, 16);
+    HANDLE output = (HANDLE)(uintptr_t)wcstoul(rest, &rest, 16);
+    while (*rest == L' ')
+        rest++;
+    ExitProcess(offload_worker(input, output, rest));
+}
+
+PyMethodDef phioriFutureMethods[] = {
+    {"done", (PyCFunction)phiori_future_done, METH_NOARGS,
+        "done() -> bool\n\nWhether the task is finished or cancelled, without waiting."},
+    {"cancelled", (PyCFunction)phiori_future_cancelled, METH_NOARGS,
+        "cancelled() -> bool"},
+    {"cancel", (PyCFunction)phiori_future_cancel, METH_NOARGS,
+        "cancel() -> bool\n\nTake the task off the queue, or stop the worker running it; the next task starts a new\n"
+        "worker. False once the task is finished."},
+    {"result", (PyCFunction)phiori_future_result, METH_VARARGS | METH_KEYWORDS,
+        "result(timeout=None)\n\nThe return value of the task, waiting up to timeout milliseconds for it; None waits\n"
+        "as long as it takes. Raises what the task raised, or TimeoutError."},
+    {"exception", (PyCFunction)phiori_future_exception, METH_VARARGS | METH_KEYWORDS,
+        "exception(timeout=None)\n\nWhat the task raised, or None; waits as result() does."},
+    {"add_done_callback", (PyCFunction)phiori_future_add_done_callback, METH_O,
+        "add_done_callback(fn)\n\nCall fn(future) at the start of the first request after the task is done,\n"
+        "or now if it is done already."},
+    {NULL, NULL, 0, NULL}
+};
+
+PyTypeObject phioriFutureType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = PHIORI_MODULE_NAME ".Future",
+    .tp_basicsize = sizeof(FutureObject),
+    .tp_dealloc = (destructor)phiori_future_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_doc = "Result of a task handed to a worker process by offload().",
+    .tp_traverse = (traverseproc)phiori_future_traverse,
+    .tp_clear = (inquiry)phiori_future_clear,
+    .tp_methods = phioriFutureMethods
+};
+
+int offload_init_module(PyObject *module) {
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (!pickle)
+        return 0;
+    offloadDumps = PyObject_GetAttrString(pickle, "dumps");
+    offloadLoads = PyObject_GetAttrString(pickle, "loads");
+    Py_DECREF(pickle);
+    if (!offloadDumps || !offloadLoads || PyType_Ready(&phioriFutureType) < 0)
+        return 0;
+    Py_INCREF(&phioriFutureType);
+    return PyModule_AddObject(module, "Future", (PyObject *)&phioriFutureType) == 0;
+}
@@ -0,0 +1,21 @@
+#ifndef _PHIORI_OFFLOAD
+#define _PHIORI_OFFLOAD 1
+#include <wchar.h>
+#include <Python.h>
+
+#define OFFLOAD_MAX_WORKERS 16
+#define OFFLOAD_DEFAULT_WORKERS 4
+#define OFFLOAD_PICKLE_PROTOCOL 4
+
+int LOAD_Offload(const wchar_t *rootW);
+// called with the GIL held, before python is finalized.
+int UNLOAD_Offload(void);
+int offload_init_module(PyObject *module);
+// called with the GIL held at the start of a request; runs the callbacks of finished tasks.
+void offload_dispatch(void);
+void offload_stats(PyObject *dict);
+
+PyObject *phiori_offload(PyObject *self, PyObject *args, PyObject *kwargs);
+PyObject *phiori_offload_workers(PyObject *self, PyObject *args);
+
+#endif
@@ -1,5 +1,17 @@
+#include "coalesce.h"
+#include "dictionary.h"
+#include "filter.h"
+#include "gcsched.h"
+#include "log.h"
+#include "message.h"
+#include "module.h"
+#include "offload.h"
 #include "phiori.h"
+#include "plugin.h"
+#include "profiler.h"
 #include "shiori.h"
+#include "store.h"
+#include "watchdog.h"
 #include <stdio.h>
 #include <string.h>
 #include <wchar.h>
@@ -10,6 +22,7 @@ const wchar_t *PYTHON_DLL_NAME_W = L"python35.dll";
 const char *PYTHON_LIB_NAME = "python35.zip";
 
 BOOL checkPython(void);
+void unwindLoad(BOOL python, BOOL watchdog);
 void getTraceback(void);
 PyObject *PyUnicode_ToSakuraScript(PyObject *value);
 
@@ -25,6 +38,10 @@ PyObject *errorType;
 PyObject *errorValue;
 PyObject *errorTraceback;
 
+PyThreadState *mainThreadState;
+// the timeout message answers only the request which overran.
+BOOL requestTimedOut;
+
 BOOL LOAD(HGLOBAL h, long len) {
     BOOL result = TRUE;
     phioriRoot = calloc(len + 1, sizeof(char));
@@ -40,24 +57,52 @@ BOOL LOAD(HGLOBAL h, long len) {
     if (!phioriNameW)
         return FALSE;
     wcscpy(phioriNameW, phioriRootW);
+    // keeps going after a failed load; shiori's unload() stops it.
+    LOAD_Log(phioriRootW);
     if (!checkPython()) {
         IS_ERROR = TRUE;
         ERROR_MESSAGE = "Unable to load python library.";
+        log_print(LOG_PHIORI, ERROR_MESSAGE);
         return FALSE;
     }
+    LOAD_Filter();
+    LOAD_Coalesce();
+    LOAD_Profiler();
+    LOAD_Plugin(phioriRoot, phioriRootW);
+    // phiori.store raises OSError if this fails.
+    LOAD_Store(phioriRootW);
+    // mapped before python starts; phiori.dictionary is None without it.
+    LOAD_Dictionary(phioriRootW);
+    // phiori.offload raises RuntimeError if this fails.
+    LOAD_Offload(phioriRootW);
     SetCurrentDirectory(phioriRootW);
     Py_SetProgramName(phioriNameW);
     Py_SetPythonHome(phioriRootW);
+    PyImport_AppendInittab(PHIORI_MODULE_NAME, PyInit__phiori);
     Py_Initialize();
     if (!Py_IsInitialized()) {
         ERROR_MESSAGE = "Failed to initialise python.";
+        log_print(LOG_PHIORI, ERROR_MESSAGE);
         IS_ERROR = TRUE;
+        unwindLoad(FALSE, FALSE);
+        return FALSE;
+    }
+    PyEval_InitThreads();
+    if (!log_redirect())
+        PyErr_Clear();
+    if (!LOAD_Watchdog()) {
+        ERROR_MESSAGE = "Failed to start watchdog.";
+        log_print(LOG_PHIORI, ERROR_MESSAGE);
+        IS_ERROR = TRUE;
+        unwindLoad(TRUE, TRUE);
         return FALSE;
     }
     tracebackModule = PyImport_ImportModule("traceback");
     if (tracebackModule == NULL) {
         ERROR_MESSAGE = "Failed to initialise python.";
+        log_print(LOG_PHIORI, ERROR_MESSAGE);
         IS_ERROR = TRUE;
+        unwindLoad(TRUE, TRUE);
         return FALSE;
     }
     phioriModule = PyImport_ImportModule("phiori");
@@ -69,6 +114,10 @@ BOOL LOAD(HGLOBAL h, long len) {
             getTraceback();
         }
     }
+    else if (!PyModule_ExposePhiori(phioriModule)) {
+        result = FALSE;
+        getTraceback();
+    }
     else {
         PyObject *func = PyObject_GetAttrString(phioriModule, "load");
         if (func == NULL || !PyCallable_Check(func)) {
@@ -89,11 +138,19 @@ BOOL LOAD(HGLOBAL h, long len) {
         }
     }
     IS_LOADED = result;
+    // collect in idle gaps rather than in the middle of handlers.
+    if (IS_LOADED && !LOAD_GC())
+        PyErr_Clear();
+    // requests take the GIL only when they reach python.
+    mainThreadState = PyEval_SaveThread();
     return result;
 }
 
 BOOL UNLOAD(void) {
     BOOL result = TRUE;
+    UNLOAD_GC();
+    UNLOAD_Watchdog();
+    PyEval_RestoreThread(mainThreadState);
     PyErr_Clear();
     if (IS_LOADED) {
         PyObject *func = PyObject_GetAttrString(phioriModule, "unload");
@@ -104,13 +161,36 @@ BOOL UNLOAD(void) {
             Py_XDECREF(callResult);
         }
     }
+    UNLOAD_Offload();
+    UNLOAD_Profiler();
     Py_Finalize();
+    UNLOAD_Plugin();
+    UNLOAD_Store();
+    UNLOAD_Dictionary();
     free(phioriNameW);
     free(phioriRootW);
     free(phioriRoot);
+    UNLOAD_Coalesce();
+    UNLOAD_Filter();
     return result;
 }
 
+// releases what LOAD set up before failing; shiori's unload() skips UNLOAD() after IS_ERROR.
+void unwindLoad(BOOL python, BOOL watchdog) {
+    if (watchdog)
+        UNLOAD_Watchdog();
+    // without python there are no futures to let go of.
+    UNLOAD_Offload();
+    UNLOAD_Profiler();
+    if (python)
+        Py_Finalize();
+    UNLOAD_Plugin();
+    UNLOAD_Store();
+    UNLOAD_Dictionary();
+    UNLOAD_Coalesce();
+    UNLOAD_Filter();
+}
+
 HGLOBAL REQUEST(HGLOBAL h, long *len) {
     char *result = NULL;
     if (!IS_LOADED) {
@@ -118,30 +198,77 @@ HGLOBAL REQUEST(HGLOBAL h, long *len) {
             ERROR_MESSAGE = "Error has occurred while loading phiori core.";
         return NULL;
     }
-    char *req = malloc(*len);
-    if (!req) {
-        *len = 0;
-        return NULL;
+    char *req = h;
+    long reqLen = *len;
+    char *rewritten = NULL;
+    size_t idLen;
+    const char *id = message_get_event(h, *len, &idLen);
+    if (id) {
+        if (profiler_control(h, *len, id, idLen))
+            return message_build_status(h, *len, SHIORI_204, len);
+        long nativeLen;
+        char *native = plugin_dispatch(h, *len, id, idLen, &nativeLen);
+        if (native) {
+            *len = nativeLen;
+            return native;
+        }
+        if (!filter_accepts(id, idLen))
+            return message_build_status(h, *len, SHIORI_204, len);
+        if (coalesce_absorb(h, *len, id, idLen, &rewritten, &reqLen) == COALESCE_ABSORB)
+            return message_build_status(h, *len, SHIORI_204, len);
+        if (rewritten)
+            req = rewritten;
+        else
+            reqLen = *len;
+    }
+    if (requestTimedOut) {
+        requestTimedOut = FALSE;
+        ERROR_MESSAGE = NULL;
+        SHOW_ERROR = FALSE;
     }
-    memcpy(req, h, *len);
+    gc_request_enter();
+    PyGILState_STATE gil = PyGILState_Ensure();
+    offload_dispatch();
     PyObject *func = PyObject_GetAttrString(phioriModule, "request");
     if (func == NULL || !PyCallable_Check(func)) {
-        PyObject *err = PyErr_Occurred();
-        if (err != NULL) {
-            Py_XDECREF(err);
+        if (PyErr_Occurred())
             getTraceback();
-        }
     }
     else {
-        PyObject *arg0 = PyBytes_FromStringAndSize(req, *len);
-        PyObject *arg1 = PyLong_FromLong(*len);
+        PyObject *arg0 = PyBytes_FromStringAndSize(req, reqLen);
+        PyObject *arg1 = PyLong_FromLong(reqLen);
+        gc_request_begin();
+        profiler_begin(id, idLen);
+        watchdog_arm(id, idLen);
         PyObject *callResult = PyObject_CallFunctionObjArgs(func, arg0, arg1, NULL);
-        if (callResult != NULL)
-            result = PyBytes_AsString(callResult);
+        int overrun = watchdog_disarm();
+        profiler_end();
+        gc_request_end();
+        if (callResult == NULL && overrun && PyErr_ExceptionMatches(RequestTimeoutError)) {
+            // let the emergency layer answer with the timeout and where it hung.
+            getTraceback();
+            ERROR_MESSAGE = REQUEST_TIMEOUT_MESSAGE;
+            SHOW_ERROR = TRUE;
+            requestTimedOut = TRUE;
+        }
+        else if (callResult != NULL && PyBytes_Check(callResult)) {
+            // request() frees the response, so hand over a copy of the bytes.
+            Py_ssize_t size = PyBytes_GET_SIZE(callResult);
+            result = malloc(size + 1);
+            if (result) {
+                memcpy(result, PyBytes_AS_STRING(callResult), size + 1);
+                *len = (long)size;
+            }
+        }
+        else if (PyErr_Occurred())
+            getTraceback();
         Py_XDECREF(callResult);
         Py_XDECREF(arg1);
         Py_XDECREF(arg0);
     }
+    Py_XDECREF(func);
+    PyGILState_Release(gil);
+    free(rewritten);
     return result;
 }
 
@@ -202,6 +329,11 @@ void getTraceback(void) {
             PyObject *sakura_rslash = PyUnicode_FromString("\\\\");
             PyObject *sakura_newLine2 = PyUnicode_FromString("\\n\\n");
             PyObject *sakura_newLineH = PyUnicode_FromString("\\n\\n[half]");
+            PyObject *empty = PyUnicode_FromString("");
+            PyObject *plainTraceback = empty ? PyUnicode_Join(empty, callResult) : NULL;
+            log_object(LOG_PHIORI, plainTraceback);
+            Py_XDECREF(plainTraceback);
+            Py_XDECREF(empty);
             PyObject *tracebackString = PyUnicode_Join(newLine, callResult);
             PyObject *newTracebackString = PyUnicode_Replace(tracebackString, rslash, sakura_rslash, -1);
             Py_XDECREF(tracebackString);
@@ -221,7 +353,15 @@ void getTraceback(void) {
             Py_XDECREF(newLine);
             PyObject *tracebackAscii = PyUnicode_AsEncodedString(tracebackString, "ascii", "replace");
             Py_XDECREF(tracebackString);
-            ERROR_TRACEBACK = PyBytes_AsString(tracebackAscii);
+            if (tracebackAscii) {
+                // keep a copy; the bytes object goes away below.
+                char *traceback = malloc(PyBytes_GET_SIZE(tracebackAscii) + 1);
+                if (traceback) {
+                    memcpy(traceback, PyBytes_AS_STRING(tracebackAscii), PyBytes_GET_SIZE(tracebackAscii) + 1);
+                    free(ERROR_TRACEBACK);
+                    ERROR_TRACEBACK = traceback;
+                }
+            }
             Py_XDECREF(tracebackAscii);
         }
         Py_XDECREF(callResult);
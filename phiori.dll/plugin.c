@@ -0,0 +1,347 @@
+#include "message.h"
+#include "plugin.h"
+#include "pluginapi.h"
+#include "strmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <Windows.h>
+#include <Python.h>
+
+#define SENTENCE_STRING "Sentence"
+#define VALUE_STRING "Value"
+
+#define PLUGIN_STATUS_MAX 64
+
+typedef struct _PLUGIN_MODULE {
+    HMODULE module;
+    char *name;
+    PHIORI_PLUGIN_UNLOAD unload;
+    struct _PLUGIN_MODULE *next;
+} PLUGIN_MODULE;
+
+typedef struct _PLUGIN_HANDLER {
+    PHIORI_HANDLER handler;
+    void *userdata;
+    PLUGIN_MODULE *owner;
+} PLUGIN_HANDLER;
+
+struct _PHIORI_RESPONSE {
+    const char *ver;
+    const char *stat;
+    // a copy of the status set by the handler, which may live on its stack.
+    char stat_buffer[PLUGIN_STATUS_MAX];
+    const char *value_key;
+    char *headers;
+    size_t headers_len;
+    size_t headers_capacity;
+    char *value;
+    size_t value_len;
+    size_t value_capacity;
+};
+
+STRMAP pluginHandlers;
+PLUGIN_MODULE *pluginModules;
+// plugin whose phiori_plugin_init is running.
+PLUGIN_MODULE *pluginLoading;
+char *pluginRoot;
+volatile LONG64 pluginHandled;
+volatile LONG64 pluginDeclined;
+
+int plugin_buffer_append(char **buf, size_t *len, size_t *capacity, const char *value, size_t value_len) {
+    if (*len + value_len + 1 > *capacity) {
+        size_t capacity_t = (*len + value_len + 1) * 2;
+        char *buf_t = realloc(*buf, capacity_t);
+        if (!buf_t)
+            return 0;
+        *buf = buf_t;
+        *capacity = capacity_t;
+    }
+    memcpy(*buf + *len, value, value_len);
+    *len += value_len;
+    (*buf)[*len] = '\0';
+    return 1;
+}
+
+int __cdecl plugin_register_handler(const char *id, PHIORI_HANDLER handler, void *userdata) {
+    if (!pluginLoading || !id || !handler)
+        return 0;
+    STRMAP_ENTRY *entry = strmap_put(&pluginHandlers, id, strlen(id));
+    // the first plugin to claim an id keeps it.
+    if (!entry || entry->value)
+        return 0;
+    PLUGIN_HANDLER *value = malloc(sizeof(PLUGIN_HANDLER));
+    if (!value) {
+        strmap_remove(&pluginHandlers, id, strlen(id), NULL);
+        return 0;
+    }
+    value->handler = handler;
+    value->userdata = userdata;
+    value->owner = pluginLoading;
+    entry->value = value;
+    return 1;
+}
+
+const char *__cdecl plugin_get_header(const PHIORI_REQUEST *req, const char *key) {
+    for (size_t i = 0; i < req->header_count; i++)
+        if (strcmp(req->headers[i].key, key) == 0)
+            return req->headers[i].value;
+    return NULL;
+}
+
+// a line break would end the field and let the plugin write headers of its own.
+int plugin_is_field(const char *value, size_t len) {
+    return !memchr(value, '\r', len) && !memchr(value, '\n', len);
+}
+
+void __cdecl plugin_set_status(PHIORI_RESPONSE *res, const char *stat) {
+    size_t len = stat ? strlen(stat) : 0;
+    if (!stat || len >= sizeof(res->stat_buffer) || !plugin_is_field(stat, len))
+        return;
+    memcpy(res->stat_buffer, stat, len + 1);
+    res->stat = res->stat_buffer;
+}
+
+int __cdecl plugin_set_header(PHIORI_RESPONSE *res, const char *key, const char *value) {
+    if (!key || !value || !*key || strchr(key, ':') || !plugin_is_field(key, strlen(key)) || !plugin_is_field(value, strlen(value)))
+        return 0;
+    return plugin_buffer_append(&res->headers, &res->headers_len, &res->headers_capacity, key, strlen(key))
+        && plugin_buffer_append(&res->headers, &res->headers_len, &res->headers_capacity, ": ", 2)
+        && plugin_buffer_append(&res->headers, &res->headers_len, &res->headers_capacity, value, strlen(value))
+        && plugin_buffer_append(&res->headers, &res->headers_len, &res->headers_capacity, "\r\n", 2);
+}
+
+int __cdecl plugin_append_value(PHIORI_RESPONSE *res, const char *value, size_t len) {
+    if (!value || !plugin_is_field(value, len))
+        return 0;
+    return plugin_buffer_append(&res->value, &res->value_len, &res->value_capacity, value, len);
+}
+
+const PHIORI_PLUGIN_API pluginApiTemplate = {
+    PHIORI_PLUGIN_ABI_VERSION,
+    NULL,
+    plugin_register_handler,
+    plugin_get_header,
+    plugin_set_status,
+    plugin_set_header,
+    plugin_append_value
+};
+
+void plugin_unregister(PLUGIN_MODULE *owner) {
+    STRMAP_FOREACH(pluginHandlers, entry)
+        if (entry->value && ((PLUGIN_HANDLER *)entry->value)->owner == owner) {
+            free(entry->value);
+            entry->value = NULL;
+        }
+}
+
+int LOAD_Plugin(const char *root, const wchar_t *rootW) {
+    size_t root_len = wcslen(rootW);
+    wchar_t *path = calloc(root_len + wcslen(PLUGIN_DIRECTORY_W) + MAX_PATH + 1, sizeof(wchar_t));
+    if (!path)
+        return 0;
+    pluginRoot = malloc(strlen(root) + 1);
+    if (!pluginRoot) {
+        free(path);
+        return 0;
+    }
+    strcpy(pluginRoot, root);
+    PHIORI_PLUGIN_API api = pluginApiTemplate;
+    api.ghost_root = pluginRoot;
+    wcscpy(path, rootW);
+    wcscat(path, PLUGIN_DIRECTORY_W);
+    size_t dir_len = wcslen(path);
+    wcscat(path, L"*.dll");
+    WIN32_FIND_DATAW data;
+    HANDLE find = FindFirstFileW(path, &data);
+    if (find == INVALID_HANDLE_VALUE) {
+        free(path);
+        return 1;
+    }
+    do {
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        wcscpy(path + dir_len, data.cFileName);
+        // let the plugin find its own dependencies next to it.
+        HMODULE module = LoadLibraryExW(path, NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+        if (!module)
+            continue;
+        PHIORI_PLUGIN_INIT init = (PHIORI_PLUGIN_INIT)GetProcAddress(module, PHIORI_PLUGIN_INIT_NAME);
+        PLUGIN_MODULE *plugin = init ? calloc(1, sizeof(PLUGIN_MODULE)) : NULL;
+        if (!plugin) {
+            FreeLibrary(module);
+            continue;
+        }
+        plugin->module = module;
+        plugin->unload = (PHIORI_PLUGIN_UNLOAD)GetProcAddress(module, PHIORI_PLUGIN_UNLOAD_NAME);
+        size_t name_sz = WideCharToMultiByte(CP_UTF8, 0, data.cFileName, -1, NULL, 0, NULL, NULL);
+        plugin->name = calloc(name_sz ? name_sz : 1, sizeof(char));
+        if (plugin->name && name_sz)
+            WideCharToMultiByte(CP_UTF8, 0, data.cFileName, -1, plugin->name, (int)name_sz, NULL, NULL);
+        pluginLoading = plugin;
+        int result = init(&api);
+        pluginLoading = NULL;
+        if (!result) {
+            plugin_unregister(plugin);
+            FreeLibrary(module);
+            free(plugin->name);
+            free(plugin);
+            continue;
+        }
+        plugin->next = pluginModules;
+        pluginModules = plugin;
+    } while (FindNextFileW(find, &data));
+    FindClose(find);
+    free(path);
+    return 1;
+}
+
+int UNLOAD_Plugin(void) {
+    strmap_clear(&pluginHandlers, free);
+    while (pluginModules) {
+        PLUGIN_MODULE *plugin = pluginModules;
+        pluginModules = plugin->next;
+        if (plugin->unload)
+            plugin->unload();
+        FreeLibrary(plugin->module);
+        free(plugin->name);
+        free(plugin);
+    }
+    free(pluginRoot);
+    pluginRoot = NULL;
+    return 1;
+}
+
+// splits a copy of the request into lines in place.
+int plugin_parse(char *buf, size_t len, PHIORI_REQUEST *req, PHIORI_HEADER **headers) {
+    size_t capacity = 0;
+    char *line = buf;
+    char *end = buf + len;
+    *headers = NULL;
+    memset(req, 0, sizeof(PHIORI_REQUEST));
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+        char *line_end = eol;
+        if (line_end > line && line_end[-1] == '\r')
+            line_end--;
+        *line_end = '\0';
+        if (!req->method) {
+            // "GET SHIORI/3.0" or "GET Sentence SHIORI/2.2"
+            req->method = line;
+            char *sp = strchr(line, ' ');
+            if (!sp)
+                return 0;
+            *sp = '\0';
+            req->version = strrchr(sp + 1, ' ');
+            req->version = req->version ? req->version + 1 : sp + 1;
+        }
+        else if (line_end == line)
+            break;
+        else {
+            char *colon = strchr(line, ':');
+            if (colon) {
+                if (req->header_count == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    PHIORI_HEADER *headers_t = realloc(*headers, capacity * sizeof(PHIORI_HEADER));
+                    if (!headers_t)
+                        return 0;
+                    *headers = headers_t;
+                    req->headers = headers_t;
+                }
+                *colon = '\0';
+                char *value = colon + 1;
+                while (*value == ' ')
+                    value++;
+                (*headers)[req->header_count].key = line;
+                (*headers)[req->header_count].value = value;
+                req->header_count++;
+            }
+        }
+        line = eol + 1;
+    }
+    return req->method != NULL;
+}
+
+char *plugin_build(const PHIORI_RESPONSE *res, long *res_len) {
+    size_t resraw_len = strlen(res->ver) + strlen(res->stat) + res->headers_len + 6;
+    if (res->value)
+        resraw_len += strlen(res->value_key) + res->value_len + 4;
+    char *resraw = malloc(resraw_len);
+    if (!resraw)
+        return NULL;
+    char *resraw_p = resraw + sprintf(resraw, "%s %s\r\n", res->ver, res->stat);
+    if (res->headers) {
+        memcpy(resraw_p, res->headers, res->headers_len);
+        resraw_p += res->headers_len;
+    }
+    if (res->value)
+        resraw_p += sprintf(resraw_p, "%s: %s\r\n", res->value_key, res->value);
+    strcpy(resraw_p, "\r\n");
+    *res_len = (long)(resraw_p + 2 - resraw);
+    return resraw;
+}
+
+char *plugin_dispatch(const char *raw, size_t len, const char *id, size_t id_len, long *res_len) {
+    STRMAP_ENTRY *entry = strmap_get(&pluginHandlers, id, id_len);
+    if (!entry || !entry->value)
+        return NULL;
+    PLUGIN_HANDLER *handler = entry->value;
+    char *buf = malloc(len + 1);
+    if (!buf)
+        return NULL;
+    memcpy(buf, raw, len);
+    buf[len] = '\0';
+    char *result = NULL;
+    PHIORI_HEADER *headers;
+    PHIORI_REQUEST req;
+    if (plugin_parse(buf, len, &req, &headers)) {
+        int shiori3 = message_is_shiori3(raw, len);
+        PHIORI_RESPONSE res = {NULL, SHIORI_200, {0}, NULL, NULL, 0, 0, NULL, 0, 0};
+        res.ver = shiori3 ? SHIORI30_VERSION_STRING : SHIORI25_VERSION_STRING;
+        res.value_key = shiori3 ? VALUE_STRING : SENTENCE_STRING;
+        req.id = entry->key;
+        if (handler->handler(&req, &res, handler->userdata) == PHIORI_PLUGIN_HANDLED) {
+            result = plugin_build(&res, res_len);
+            InterlockedIncrement64(&pluginHandled);
+        }
+        else
+            InterlockedIncrement64(&pluginDeclined);
+        free(res.value);
+        free(res.headers);
+    }
+    free(headers);
+    free(buf);
+    return result;
+}
+
+void plugin_stats(PyObject *dict) {
+    PyObject *stats = Py_BuildValue("{s:L,s:L}",
+        "handled", (long long)pluginHandled,
+        "declined", (long long)pluginDeclined);
+    if (stats) {
+        PyDict_SetItemString(dict, "plugin", stats);
+        Py_DECREF(stats);
+    }
+}
+
+PyObject *phiori_plugins(PyObject *self, PyObject *args) {
+    PyObject *result = PyDict_New();
+    if (!result)
+        return NULL;
+    STRMAP_FOREACH(pluginHandlers, entry) {
+        PLUGIN_HANDLER *handler = entry->value;
+        if (!handler)
+            continue;
+        PyObject *name = PyUnicode_FromString(handler->owner->name ? handler->owner->name : "");
+        if (!name || PyDict_SetItemString(result, entry->key, name) < 0) {
+            Py_XDECREF(name);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(name);
+    }
+    return result;
+}
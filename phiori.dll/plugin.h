@@ -0,0 +1,17 @@
+#ifndef _PHIORI_PLUGIN
+#define _PHIORI_PLUGIN 1
+#include <stddef.h>
+#include <wchar.h>
+#include <Python.h>
+
+#define PLUGIN_DIRECTORY_W L"plugins\\"
+
+int LOAD_Plugin(const char *root, const wchar_t *rootW);
+int UNLOAD_Plugin(void);
+// returns a response for free() when a native handler took the request.
+char *plugin_dispatch(const char *raw, size_t len, const char *id, size_t id_len, long *res_len);
+void plugin_stats(PyObject *dict);
+
+PyObject *phiori_plugins(PyObject *self, PyObject *args);
+
+#endif
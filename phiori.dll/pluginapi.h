@@ -0,0 +1,61 @@
+#ifndef _PHIORI_PLUGINAPI
+#define _PHIORI_PLUGINAPI 1
+#include <stddef.h>
+
+/*
+ * ABI for native handler plugins.
+ *
+ * A plugin is a DLL in the "plugins" directory of the ghost. At load(),
+ * phiori calls its exported phiori_plugin_init, which registers handlers
+ * for event ids through the given api. A handler returns
+ * PHIORI_PLUGIN_HANDLED after filling the response, or
+ * PHIORI_PLUGIN_DECLINED to let phiori.request in python handle the event.
+ * Handlers run on the SHIORI thread without the GIL.
+ */
+
+#define PHIORI_PLUGIN_ABI_VERSION 1
+
+#define PHIORI_PLUGIN_DECLINED 0
+#define PHIORI_PLUGIN_HANDLED 1
+
+#define PHIORI_PLUGIN_INIT_NAME "phiori_plugin_init"
+#define PHIORI_PLUGIN_UNLOAD_NAME "phiori_plugin_unload"
+
+typedef struct _PHIORI_HEADER {
+    const char *key;
+    const char *value;
+} PHIORI_HEADER;
+
+typedef struct _PHIORI_REQUEST {
+    const char *method;
+    const char *version;
+    // "ID" on SHIORI/3, "Event" on SHIORI/2.
+    const char *id;
+    const PHIORI_HEADER *headers;
+    size_t header_count;
+} PHIORI_REQUEST;
+
+typedef struct _PHIORI_RESPONSE PHIORI_RESPONSE;
+
+typedef int (__cdecl *PHIORI_HANDLER)(const PHIORI_REQUEST *req, PHIORI_RESPONSE *res, void *userdata);
+
+typedef struct _PHIORI_PLUGIN_API {
+    unsigned int version;
+    // utf-8, with a trailing path separator.
+    const char *ghost_root;
+    // valid during phiori_plugin_init only.
+    int (__cdecl *register_handler)(const char *id, PHIORI_HANDLER handler, void *userdata);
+    const char *(__cdecl *get_header)(const PHIORI_REQUEST *req, const char *key);
+    // status line after the version, "200 OK" unless set. The string is copied;
+    // one of 64 bytes or more, or with CR or LF in it, is ignored.
+    void (__cdecl *set_status)(PHIORI_RESPONSE *res, const char *stat);
+    // fails on an empty key, a key with ':', or CR or LF in either.
+    int (__cdecl *set_header)(PHIORI_RESPONSE *res, const char *key, const char *value);
+    // appends to Value (Sentence on SHIORI/2); fails on CR or LF.
+    int (__cdecl *append_value)(PHIORI_RESPONSE *res, const char *value, size_t len);
+} PHIORI_PLUGIN_API;
+
+typedef int (__cdecl *PHIORI_PLUGIN_INIT)(const PHIORI_PLUGIN_API *api);
+typedef void (__cdecl *PHIORI_PLUGIN_UNLOAD)(void);
+
+#endif
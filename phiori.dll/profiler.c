@@ -0,0 +1,532 @@
+#include "message.h"
+#include "profiler.h"
+#include "strmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include <Python.h>
+#include <frameobject.h>
+
+#define PROFILER_NAME_MAX 256
+#define PROFILER_SAMPLE_DEPTH 128
+
+typedef struct _PROFILER_CONFIG {
+    long count;
+    char *event;
+    int mode;
+    DWORD interval;
+    char *path;
+} PROFILER_CONFIG;
+
+typedef struct _PROFILER_FUNC {
+    LONG64 calls;
+    LONG64 total_us;
+    LONG64 self_us;
+} PROFILER_FUNC;
+
+typedef struct _PROFILER_FRAME {
+    size_t path_len;
+    LONG64 start;
+    LONG64 child;
+} PROFILER_FRAME;
+
+volatile LONG profilerActive;
+CRITICAL_SECTION profilerLock;
+PROFILER_CONFIG profilerPending;
+int profilerHasPending;
+
+// everything below is touched with the GIL held only.
+PROFILER_CONFIG profilerConfig;
+int profilerRunning;
+long profilerRemaining;
+int profilerRecording;
+LARGE_INTEGER profilerFrequency;
+
+STRMAP profilerStacks;
+STRMAP profilerFunctions;
+
+// collapsed stack of the request in flight, "event;outer;...;inner".
+char *profilerPath;
+size_t profilerPathLen;
+size_t profilerPathCapacity;
+size_t profilerEventLen;
+PROFILER_FRAME *profilerFrames;
+size_t profilerDepth;
+size_t profilerFramesCapacity;
+size_t profilerLost;
+
+HANDLE profilerSampler;
+HANDLE profilerSamplerStop;
+PyThreadState *profilerThreadState;
+volatile LONG profilerSampling;
+
+void profiler_config_free(PROFILER_CONFIG *config) {
+    free(config->event);
+    free(config->path);
+    config->event = NULL;
+    config->path = NULL;
+}
+
+char *profiler_strndup(const char *value, size_t len) {
+    char *result = malloc(len + 1);
+    if (!result)
+        return NULL;
+    memcpy(result, value, len);
+    result[len] = '\0';
+    return result;
+}
+
+LONG64 profiler_now(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+LONG64 profiler_us(LONG64 ticks) {
+    return ticks * 1000000 / profilerFrequency.QuadPart;
+}
+
+void profiler_add_stack(const char *stack, size_t len, LONG64 us) {
+    STRMAP_ENTRY *entry = strmap_put(&profilerStacks, stack, len);
+    if (!entry)
+        return;
+    if (!entry->value)
+        entry->value = calloc(1, sizeof(LONG64));
+    if (entry->value)
+        *(LONG64 *)entry->value += us;
+}
+
+void profiler_add_function(const char *func, size_t len, LONG64 calls, LONG64 total_us, LONG64 self_us) {
+    // keyed "event\tfunction" so the report splits by event.
+    char key[PROFILER_NAME_MAX * 2];
+    size_t event_len = profilerEventLen < PROFILER_NAME_MAX ? profilerEventLen : PROFILER_NAME_MAX - 1;
+    if (len >= PROFILER_NAME_MAX)
+        len = PROFILER_NAME_MAX - 1;
+    memcpy(key, profilerPath, event_len);
+    key[event_len] = '\t';
+    memcpy(key + event_len + 1, func, len);
+    STRMAP_ENTRY *entry = strmap_put(&profilerFunctions, key, event_len + 1 + len);
+    if (!entry)
+        return;
+    if (!entry->value)
+        entry->value = calloc(1, sizeof(PROFILER_FUNC));
+    if (!entry->value)
+        return;
+    PROFILER_FUNC *stats = entry->value;
+    stats->calls += calls;
+    stats->total_us += total_us;
+    stats->self_us += self_us;
+}
+
+int profiler_path_reserve(size_t len) {
+    if (profilerPathLen + len + 1 > profilerPathCapacity) {
+        size_t capacity = (profilerPathLen + len + 1) * 2;
+        char *path = realloc(profilerPath, capacity);
+        if (!path)
+            return 0;
+        profilerPath = path;
+        profilerPathCapacity = capacity;
+    }
+    return 1;
+}
+
+int profiler_path_push(const char *name, size_t len) {
+    if (!profiler_path_reserve(len + 1))
+        return 0;
+    profilerPath[profilerPathLen++] = ';';
+    memcpy(profilerPath + profilerPathLen, name, len);
+    profilerPathLen += len;
+    profilerPath[profilerPathLen] = '\0';
+    return 1;
+}
+
+size_t profiler_code_name(PyCodeObject *code, char *buf) {
+    const char *name = PyUnicode_AsUTF8(code->co_name);
+    const char *file = PyUnicode_AsUTF8(code->co_filename);
+    if (!name || !file) {
+        PyErr_Clear();
+        name = name ? name : "?";
+        file = file ? file : "?";
+    }
+    const char *base = file;
+    for (const char *p = file; *p; p++)
+        if (*p == '\\' || *p == '/')
+            base = p + 1;
+    int len = snprintf(buf, PROFILER_NAME_MAX, "%s (%s:%d)", name, base, code->co_firstlineno);
+    if (len < 0)
+        return 0;
+    return len < PROFILER_NAME_MAX ? (size_t)len : PROFILER_NAME_MAX - 1;
+}
+
+size_t profiler_c_name(PyObject *func, char *buf) {
+    const char *name = PyCFunction_Check(func) ? ((PyCFunctionObject *)func)->m_ml->ml_name : Py_TYPE(func)->tp_name;
+    int len = snprintf(buf, PROFILER_NAME_MAX, "%s (builtin)", name);
+    if (len < 0)
+        return 0;
+    return len < PROFILER_NAME_MAX ? (size_t)len : PROFILER_NAME_MAX - 1;
+}
+
+int profiler_on_stack(const char *func, size_t len, size_t path_len) {
+    for (size_t i = profilerEventLen; i + len + 1 <= path_len; i++)
+        if (profilerPath[i] == ';' && memcmp(profilerPath + i + 1, func, len) == 0
+            && (i + len + 1 == path_len || profilerPath[i + len + 1] == ';'))
+            return 1;
+    return 0;
+}
+
+void profiler_enter(const char *name, size_t len) {
+    if (profilerDepth == profilerFramesCapacity) {
+        size_t capacity = profilerFramesCapacity ? profilerFramesCapacity * 2 : 64;
+        PROFILER_FRAME *frames = realloc(profilerFrames, capacity * sizeof(PROFILER_FRAME));
+        if (!frames) {
+            // keep calls and returns paired even when out of memory.
+            profilerLost++;
+            return;
+        }
+        profilerFrames = frames;
+        profilerFramesCapacity = capacity;
+    }
+    PROFILER_FRAME *frame = &profilerFrames[profilerDepth++];
+    frame->path_len = profilerPathLen;
+    frame->child = 0;
+    profiler_path_push(name, len);
+    frame->start = profiler_now();
+}
+
+void profiler_leave(void) {
+    LONG64 now = profiler_now();
+    if (profilerLost) {
+        profilerLost--;
+        return;
+    }
+    if (!profilerDepth)
+        return;
+    PROFILER_FRAME *frame = &profilerFrames[--profilerDepth];
+    LONG64 elapsed = now - frame->start;
+    LONG64 self = elapsed - frame->child;
+    if (profilerDepth)
+        profilerFrames[profilerDepth - 1].child += elapsed;
+    if (profilerPathLen > frame->path_len) {
+        profiler_add_stack(profilerPath, profilerPathLen, profiler_us(self));
+        const char *func = profilerPath + frame->path_len + 1;
+        size_t func_len = profilerPathLen - frame->path_len - 1;
+        // recursive calls are already inside the outermost one's total.
+        LONG64 total = profiler_on_stack(func, func_len, frame->path_len) ? 0 : profiler_us(elapsed);
+        profiler_add_function(func, func_len, 1, total, profiler_us(self));
+    }
+    profilerPathLen = frame->path_len;
+}
+
+int profiler_trace(PyObject *obj, PyFrameObject *frame, int what, PyObject *arg) {
+    char name[PROFILER_NAME_MAX];
+    switch (what) {
+    case PyTrace_CALL:
+        profiler_enter(name, profiler_code_name(frame->f_code, name));
+        break;
+    case PyTrace_C_CALL:
+        profiler_enter(name, profiler_c_name(arg, name));
+        break;
+    case PyTrace_RETURN:
+    case PyTrace_C_RETURN:
+    case PyTrace_C_EXCEPTION:
+        profiler_leave();
+        break;
+    }
+    return 0;
+}
+
+void profiler_sample(void) {
+    char names[PROFILER_SAMPLE_DEPTH][PROFILER_NAME_MAX];
+    size_t lens[PROFILER_SAMPLE_DEPTH];
+    size_t depth = 0;
+    for (PyFrameObject *frame = profilerThreadState->frame; frame && depth < PROFILER_SAMPLE_DEPTH; frame = frame->f_back) {
+        lens[depth] = profiler_code_name(frame->f_code, names[depth]);
+        depth++;
+    }
+    LONG64 us = (LONG64)profilerConfig.interval * 1000;
+    profilerPathLen = profilerEventLen;
+    for (size_t i = depth; i > 0; i--) {
+        size_t j = i - 1;
+        if (!profiler_path_push(names[j], lens[j]))
+            return;
+        // count a function once per sample however deep it recurses.
+        size_t k;
+        for (k = depth - 1; k > j; k--)
+            if (lens[k] == lens[j] && memcmp(names[k], names[j], lens[j]) == 0)
+                break;
+        if (k == j)
+            profiler_add_function(names[j], lens[j], 0, us, j == 0 ? us : 0);
+    }
+    profiler_add_stack(profilerPath, profilerPathLen, us);
+}
+
+DWORD WINAPI profiler_sample_main(LPVOID param) {
+    while (WaitForSingleObject(profilerSamplerStop, profilerConfig.interval) == WAIT_TIMEOUT) {
+        if (!profilerSampling)
+            continue;
+        PyGILState_STATE gil = PyGILState_Ensure();
+        if (profilerSampling)
+            profiler_sample();
+        PyGILState_Release(gil);
+    }
+    return 0;
+}
+
+int profiler_compare_functions(const void *a, const void *b) {
+    const STRMAP_ENTRY *x = *(const STRMAP_ENTRY **)a;
+    const STRMAP_ENTRY *y = *(const STRMAP_ENTRY **)b;
+    size_t xl = strcspn(x->key, "\t");
+    size_t yl = strcspn(y->key, "\t");
+    int result = strncmp(x->key, y->key, xl < yl ? xl : yl);
+    if (result || xl != yl)
+        return result ? result : (xl < yl ? -1 : 1);
+    LONG64 xt = ((PROFILER_FUNC *)x->value)->total_us;
+    LONG64 yt = ((PROFILER_FUNC *)y->value)->total_us;
+    return xt > yt ? -1 : xt < yt;
+}
+
+void profiler_write(void) {
+    const char *path = profilerConfig.path ? profilerConfig.path : PROFILER_DEFAULT_PATH;
+    char *file_path = malloc(strlen(path) + 8);
+    if (!file_path)
+        return;
+    // collapsed stacks, as consumed by flamegraph.pl and friends.
+    sprintf(file_path, "%s.folded", path);
+    FILE *file = fopen(file_path, "w");
+    if (file) {
+        STRMAP_FOREACH(profilerStacks, entry)
+            if (entry->value)
+                fprintf(file, "%s %lld\n", entry->key, (long long)*(LONG64 *)entry->value);
+        fclose(file);
+    }
+    sprintf(file_path, "%s.tsv", path);
+    file = fopen(file_path, "w");
+    STRMAP_ENTRY **entries = profilerFunctions.count ? calloc(profilerFunctions.count, sizeof(STRMAP_ENTRY *)) : NULL;
+    if (file) {
+        fprintf(file, "event\tfunction\tcalls\ttotal_us\tself_us\n");
+        size_t count = 0;
+        if (entries) {
+            STRMAP_FOREACH(profilerFunctions, entry)
+                if (entry->value)
+                    entries[count++] = entry;
+            qsort(entries, count, sizeof(STRMAP_ENTRY *), profiler_compare_functions);
+        }
+        for (size_t i = 0; i < count; i++) {
+            PROFILER_FUNC *stats = entries[i]->value;
+            fprintf(file, "%s\t%lld\t%lld\t%lld\n", entries[i]->key,
+                (long long)stats->calls, (long long)stats->total_us, (long long)stats->self_us);
+        }
+        fclose(file);
+    }
+    free(entries);
+    free(file_path);
+}
+
+void profiler_finish(void) {
+    if (profilerRecording) {
+        if (profilerConfig.mode == PROFILER_TRACE)
+            PyEval_SetProfile(NULL, NULL);
+        profilerRecording = 0;
+    }
+    profilerSampling = 0;
+    if (profilerSampler) {
+        // the sampler may be waiting for the GIL.
+        SetEvent(profilerSamplerStop);
+        Py_BEGIN_ALLOW_THREADS
+        WaitForSingleObject(profilerSampler, INFINITE);
+        Py_END_ALLOW_THREADS
+        CloseHandle(profilerSampler);
+        CloseHandle(profilerSamplerStop);
+        profilerSampler = NULL;
+        profilerSamplerStop = NULL;
+    }
+    if (profilerRunning)
+        profiler_write();
+    strmap_clear(&profilerStacks, free);
+    strmap_clear(&profilerFunctions, free);
+    profiler_config_free(&profilerConfig);
+    profilerRunning = 0;
+    EnterCriticalSection(&profilerLock);
+    if (!profilerHasPending)
+        profilerActive = 0;
+    LeaveCriticalSection(&profilerLock);
+}
+
+void profiler_apply(void) {
+    EnterCriticalSection(&profilerLock);
+    if (!profilerHasPending) {
+        LeaveCriticalSection(&profilerLock);
+        return;
+    }
+    PROFILER_CONFIG config = profilerPending;
+    profilerPending.event = NULL;
+    profilerPending.path = NULL;
+    profilerHasPending = 0;
+    LeaveCriticalSection(&profilerLock);
+    if (profilerRunning)
+        profiler_finish();
+    if (config.count < 0) {
+        profiler_config_free(&config);
+        return;
+    }
+    profilerConfig = config;
+    profilerRemaining = config.count;
+    profilerRunning = 1;
+    profilerActive = 1;
+    if (config.mode == PROFILER_SAMPLE) {
+        profilerSamplerStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (profilerSamplerStop)
+            profilerSampler = CreateThread(NULL, 0, profiler_sample_main, NULL, 0, NULL);
+        if (!profilerSampler)
+            profiler_finish();
+    }
+}
+
+int LOAD_Profiler(void) {
+    InitializeCriticalSection(&profilerLock);
+    QueryPerformanceFrequency(&profilerFrequency);
+    profilerActive = 0;
+    return 1;
+}
+
+int UNLOAD_Profiler(void) {
+    if (profilerRunning)
+        profiler_finish();
+    profiler_config_free(&profilerPending);
+    free(profilerPath);
+    free(profilerFrames);
+    profilerPath = NULL;
+    profilerFrames = NULL;
+    profilerPathCapacity = profilerFramesCapacity = 0;
+    DeleteCriticalSection(&profilerLock);
+    return 1;
+}
+
+int profiler_start(long count, const char *event, size_t event_len, int mode, unsigned long interval, const char *path) {
+    PROFILER_CONFIG config = {0, NULL, 0, 0, NULL};
+    config.count = count;
+    config.mode = mode;
+    config.interval = interval ? (DWORD)interval : PROFILER_DEFAULT_INTERVAL;
+    if (event && event_len)
+        config.event = profiler_strndup(event, event_len);
+    if (path)
+        config.path = profiler_strndup(path, strlen(path));
+    if ((event && event_len && !config.event) || (path && !config.path)) {
+        profiler_config_free(&config);
+        return 0;
+    }
+    EnterCriticalSection(&profilerLock);
+    profiler_config_free(&profilerPending);
+    profilerPending = config;
+    profilerHasPending = 1;
+    profilerActive = 1;
+    LeaveCriticalSection(&profilerLock);
+    return 1;
+}
+
+int profiler_control(const char *raw, size_t len, const char *id, size_t id_len) {
+    if (id_len != sizeof(PROFILER_RESERVED_ID) - 1 || memcmp(id, PROFILER_RESERVED_ID, id_len) != 0)
+        return 0;
+    // Reference0: request count (0 stops), Reference1: event id, Reference2: "trace" or "sample",
+    // Reference3: sampling interval in milliseconds.
+    char buf[32];
+    size_t value_len;
+    long count = PROFILER_DEFAULT_COUNT;
+    unsigned long interval = PROFILER_DEFAULT_INTERVAL;
+    const char *value = message_get(raw, len, "Reference0", &value_len);
+    if (value && value_len < sizeof(buf)) {
+        memcpy(buf, value, value_len);
+        buf[value_len] = '\0';
+        count = strtol(buf, NULL, 10);
+    }
+    value = message_get(raw, len, "Reference3", &value_len);
+    if (value && value_len < sizeof(buf)) {
+        memcpy(buf, value, value_len);
+        buf[value_len] = '\0';
+        interval = strtoul(buf, NULL, 10);
+    }
+    value = message_get(raw, len, "Reference2", &value_len);
+    int mode = value && value_len == 6 && memcmp(value, "sample", 6) == 0 ? PROFILER_SAMPLE : PROFILER_TRACE;
+    size_t event_len;
+    const char *event = message_get(raw, len, "Reference1", &event_len);
+    profiler_start(count > 0 ? count : -1, event, event_len, mode, interval, NULL);
+    return 1;
+}
+
+void profiler_begin(const char *id, size_t id_len) {
+    if (!profilerActive)
+        return;
+    profiler_apply();
+    if (!profilerRunning)
+        return;
+    const char *event = profilerConfig.event;
+    if (event && (!id || strlen(event) != id_len || memcmp(event, id, id_len) != 0))
+        return;
+    // every stack of this request is rooted at its event id.
+    profilerPathLen = 0;
+    profilerDepth = 0;
+    profilerLost = 0;
+    if (!profiler_path_reserve(id_len))
+        return;
+    if (id)
+        memcpy(profilerPath, id, id_len);
+    profilerPathLen = profilerEventLen = id ? id_len : 0;
+    profilerPath[profilerPathLen] = '\0';
+    profilerRecording = 1;
+    if (profilerConfig.mode == PROFILER_TRACE)
+        PyEval_SetProfile(profiler_trace, NULL);
+    else {
+        profilerThreadState = PyThreadState_Get();
+        profilerSampling = 1;
+    }
+}
+
+void profiler_end(void) {
+    if (!profilerRecording)
+        return;
+    if (profilerConfig.mode == PROFILER_TRACE)
+        PyEval_SetProfile(NULL, NULL);
+    else
+        profilerSampling = 0;
+    profilerRecording = 0;
+    if (profilerConfig.count > 0 && --profilerRemaining <= 0)
+        profiler_finish();
+}
+
+PyObject *phiori_profile(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"count", "event", "mode", "interval", "path", NULL};
+    long count = PROFILER_DEFAULT_COUNT;
+    PyObject *eventObj = Py_None;
+    const char *mode = "trace";
+    unsigned long interval = PROFILER_DEFAULT_INTERVAL;
+    const char *path = PROFILER_DEFAULT_PATH;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|lOsks", keywords, &count, &eventObj, &mode, &interval, &path))
+        return NULL;
+    const char *event = NULL;
+    Py_ssize_t event_len = 0;
+    if (eventObj != Py_None) {
+        event = PyUnicode_Check(eventObj) ? PyUnicode_AsUTF8AndSize(eventObj, &event_len) : NULL;
+        if (!event) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError, "event must be str or None");
+            return NULL;
+        }
+    }
+    int modeValue;
+    if (strcmp(mode, "trace") == 0)
+        modeValue = PROFILER_TRACE;
+    else if (strcmp(mode, "sample") == 0)
+        modeValue = PROFILER_SAMPLE;
+    else {
+        PyErr_SetString(PyExc_ValueError, "mode must be 'trace' or 'sample'");
+        return NULL;
+    }
+    // a negative count keeps profiling until profile(0) is called.
+    if (!profiler_start(count == 0 ? -1 : (count < 0 ? 0 : count), event, (size_t)event_len, modeValue, interval, path))
+        return PyErr_NoMemory();
+    // stopping takes effect right away; starting waits for the next request.
+    if (count == 0)
+        profiler_apply();
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,27 @@
+#ifndef _PHIORI_PROFILER
+#define _PHIORI_PROFILER 1
+#include <stddef.h>
+#include <Python.h>
+
+#define PROFILER_TRACE 0
+#define PROFILER_SAMPLE 1
+
+#define PROFILER_RESERVED_ID "phiori.profile"
+#define PROFILER_DEFAULT_COUNT 10
+#define PROFILER_DEFAULT_INTERVAL 10
+#define PROFILER_DEFAULT_PATH "phiori.profile"
+
+int LOAD_Profiler(void);
+// called with the GIL held; writes out a running session.
+int UNLOAD_Profiler(void);
+// safe without the GIL; takes effect from the next request.
+int profiler_start(long count, const char *event, size_t event_len, int mode, unsigned long interval, const char *path);
+// handles the reserved id; returns non-zero when the request was consumed.
+int profiler_control(const char *raw, size_t len, const char *id, size_t id_len);
+// called with the GIL held around the python handler.
+void profiler_begin(const char *id, size_t id_len);
+void profiler_end(void);
+
+PyObject *phiori_profile(PyObject *self, PyObject *args, PyObject *kwargs);
+
+#endif
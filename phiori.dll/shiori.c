@@ -1,4 +1,5 @@
 #include "emergency.h"
+#include "log.h"
 #include "phiori.h"
 #include "shiori.h"
 #include <stdlib.h>
@@ -17,6 +18,7 @@ BOOL unload(void) {
     result |= UNLOAD_Emergency();
     if (!IS_ERROR)
         result |= UNLOAD();
+    UNLOAD_Log();
     return result;
 }
 
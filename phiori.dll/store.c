@@ -0,0 +1,922 @@
+#include "module.h"
+#include "store.h"
+#include "strmap.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <Windows.h>
+#include <Python.h>
+
+#define STORE_MAGIC "PHISTORE"
+#define STORE_FORMAT_VERSION 1
+#define STORE_HEADER_SIZE 64
+#define STORE_TOMBSTONE 0xFFFFFFFFu
+#define STORE_MIN_SLOTS 16
+#define STORE_GROW_MIN (64 * 1024)
+#define STORE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define STORE_PICKLE_PROTOCOL 4
+#define STORE_CLOSED_MESSAGE "phiori.store is not open"
+
+/*
+ * phiori.store file layout:
+ *
+ * [header][compacted records][slot table][log tail ...][free space]
+ *
+ * Compaction writes every live record into a new file followed by an
+ * open-addressing table of their offsets, and renames it over the old one.
+ * Writes after that are appended as records behind the table, and a write
+ * counts once the header's end covers it. Opening reads the header and
+ * replays only the tail.
+ */
+
+typedef struct _STORE_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t table;
+    uint64_t slots;
+    // live keys in the compacted part.
+    uint64_t count;
+    uint64_t tail;
+    uint64_t end;
+} STORE_HEADER;
+
+typedef struct _STORE_RECORD {
+    // crc32 of the rest of the record.
+    uint32_t crc;
+    uint32_t hash;
+    uint32_t key_len;
+    // STORE_TOMBSTONE for a deletion.
+    uint32_t value_len;
+} STORE_RECORD;
+
+typedef struct _STORE_BUILD {
+    char *view;
+    size_t offset;
+    uint64_t *table;
+    size_t slots;
+} STORE_BUILD;
+
+typedef struct _StoreObject {
+    PyObject_HEAD
+} StoreObject;
+
+wchar_t *storePath;
+wchar_t *storeTempPath;
+HANDLE storeFile;
+HANDLE storeFileMapping;
+char *storeView;
+size_t storeSize;
+STORE_HEADER *storeHeader;
+// key -> offset of its latest record in the tail.
+STRMAP storeTail;
+SRWLOCK storeLock = SRWLOCK_INIT;
+size_t storeCount;
+// bytes of the records which are the latest of a live key.
+size_t storeLive;
+int storeDirty;
+uint32_t storeCrcTable[256];
+LARGE_INTEGER storeFrequency;
+
+PyObject *storeDumps;
+PyObject *storeLoads;
+
+LONG64 storeWrites;
+LONG64 storeCompactions;
+LONG64 storeCompactTotal;
+
+void store_crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+        storeCrcTable[i] = crc;
+    }
+}
+
+size_t store_data_len(const STORE_RECORD *rec) {
+    return rec->key_len + (rec->value_len == STORE_TOMBSTONE ? 0 : rec->value_len);
+}
+
+size_t store_record_size(const STORE_RECORD *rec) {
+    return STORE_ALIGN(sizeof(STORE_RECORD) + store_data_len(rec));
+}
+
+uint32_t store_crc(const STORE_RECORD *rec) {
+    const unsigned char *p = (const unsigned char *)&rec->hash;
+    size_t len = sizeof(STORE_RECORD) - sizeof(uint32_t) + store_data_len(rec);
+    uint32_t crc = 0xFFFFFFFFu;
+    while (len--)
+        crc = storeCrcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+STORE_RECORD *store_record(size_t offset) {
+    return (STORE_RECORD *)(storeView + offset);
+}
+
+// the compacted record of a slot; NULL for an empty slot, or one a damaged file points elsewhere.
+const STORE_RECORD *store_slot_record(uint64_t offset) {
+    uint64_t table = storeHeader->table;
+    if (offset < STORE_HEADER_SIZE || offset % 8 || offset > table - sizeof(STORE_RECORD))
+        return NULL;
+    const STORE_RECORD *rec = store_record((size_t)offset);
+    size_t left = (size_t)(table - offset - sizeof(STORE_RECORD));
+    if (rec->key_len > left || (rec->value_len != STORE_TOMBSTONE && rec->value_len > left - rec->key_len))
+        return NULL;
+    return rec;
+}
+
+// offset of the latest record of key, which may be a tombstone; 0 if none.
+size_t store_find(const char *key, size_t len, uint32_t hash) {
+    STRMAP_ENTRY *entry = strmap_get(&storeTail, key, len);
+    if (entry)
+        return (size_t)(uintptr_t)entry->value;
+    if (!storeHeader->slots)
+        return 0;
+    const uint64_t *slots = (const uint64_t *)(storeView + storeHeader->table);
+    size_t mask = (size_t)storeHeader->slots - 1;
+    // a damaged table may have no empty slot to stop at.
+    for (size_t n = 0, i = hash & mask; n <= mask && slots[i]; n++, i = (i + 1) & mask) {
+        const STORE_RECORD *rec = store_slot_record(slots[i]);
+        if (rec && rec->hash == hash && rec->key_len == len && memcmp(rec + 1, key, len) == 0)
+            return (size_t)slots[i];
+    }
+    return 0;
+}
+
+const STORE_RECORD *store_lookup(const char *key, size_t len) {
+    size_t offset = store_find(key, len, strmap_hash(key, len));
+    const STORE_RECORD *rec = offset ? store_record(offset) : NULL;
+    return rec && rec->value_len != STORE_TOMBSTONE ? rec : NULL;
+}
+
+// visits the latest record of every live key.
+int store_foreach(int (*visit)(const STORE_RECORD *rec, void *arg), void *arg) {
+    const uint64_t *slots = (const uint64_t *)(storeView + storeHeader->table);
+    for (size_t i = 0; i < storeHeader->slots; i++) {
+        const STORE_RECORD *rec = store_slot_record(slots[i]);
+        if (!rec)
+            continue;
+        if (!strmap_get(&storeTail, (const char *)(rec + 1), rec->key_len) && !visit(rec, arg))
+            return 0;
+    }
+    int result = 1;
+    STRMAP_FOREACH(storeTail, entry) {
+        const STORE_RECORD *rec = store_record((size_t)(uintptr_t)entry->value);
+        if (result && rec->value_len != STORE_TOMBSTONE)
+            result = visit(rec, arg);
+    }
+    return result;
+}
+
+// makes the record at offset the latest one of its key.
+int store_index(size_t offset) {
+    const STORE_RECORD *rec = store_record(offset);
+    const char *key = (const char *)(rec + 1);
+    size_t previous = store_find(key, rec->key_len, rec->hash);
+    STRMAP_ENTRY *entry = strmap_put(&storeTail, key, rec->key_len);
+    if (!entry)
+        return 0;
+    if (previous && store_record(previous)->value_len != STORE_TOMBSTONE) {
+        storeCount--;
+        storeLive -= store_record_size(store_record(previous));
+    }
+    if (rec->value_len != STORE_TOMBSTONE) {
+        storeCount++;
+        storeLive += store_record_size(rec);
+    }
+    entry->value = (void *)(uintptr_t)offset;
+    return 1;
+}
+
+int store_map(size_t size) {
+    LARGE_INTEGER current;
+    if (!GetFileSizeEx(storeFile, &current))
+        return 0;
+    if ((uint64_t)current.QuadPart < size) {
+        LARGE_INTEGER distance;
+        distance.QuadPart = size;
+        if (!SetFilePointerEx(storeFile, distance, NULL, FILE_BEGIN) || !SetEndOfFile(storeFile))
+            return 0;
+    }
+    storeFileMapping = CreateFileMappingW(storeFile, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    if (!storeFileMapping)
+        return 0;
+    storeView = MapViewOfFile(storeFileMapping, FILE_MAP_WRITE, 0, 0, size);
+    if (!storeView) {
+        CloseHandle(storeFileMapping);
+        storeFileMapping = NULL;
+        return 0;
+    }
+    storeSize = size;
+    storeHeader = (STORE_HEADER *)storeView;
+    return 1;
+}
+
+void store_unmap(void) {
+    if (storeView) {
+        UnmapViewOfFile(storeView);
+        storeView = NULL;
+        storeHeader = NULL;
+    }
+    if (storeFileMapping) {
+        CloseHandle(storeFileMapping);
+        storeFileMapping = NULL;
+    }
+    storeSize = 0;
+}
+
+int store_reserve(size_t need) {
+    if ((size_t)storeHeader->end + need <= storeSize)
+        return 1;
+    size_t size = storeSize;
+    size_t grow = size / 2;
+    if (grow < need)
+        grow = need;
+    if (grow < STORE_GROW_MIN)
+        grow = STORE_GROW_MIN;
+    store_unmap();
+    if (store_map(size + grow))
+        return 1;
+    // stay usable at the old size.
+    DWORD error = GetLastError();
+    store_map(size);
+    SetLastError(error);
+    return 0;
+}
+
+int store_valid(void) {
+    if (storeSize < STORE_HEADER_SIZE || memcmp(storeHeader->magic, STORE_MAGIC, sizeof(storeHeader->magic)) != 0
+        || storeHeader->version != STORE_FORMAT_VERSION)
+        return 0;
+    uint64_t slots = storeHeader->slots;
+    return (slots & (slots - 1)) == 0
+        && slots <= storeSize / sizeof(uint64_t)
+        && storeHeader->table >= STORE_HEADER_SIZE
+        && storeHeader->table % 8 == 0
+        && storeHeader->table + slots * sizeof(uint64_t) <= storeHeader->tail
+        && storeHeader->tail <= storeHeader->end
+        && storeHeader->end <= storeSize;
+}
+
+// returns zero if the tail could not be indexed, leaving the file as it is.
+int store_replay(void) {
+    strmap_clear(&storeTail, NULL);
+    storeCount = (size_t)storeHeader->count;
+    storeLive = (size_t)storeHeader->table - STORE_HEADER_SIZE;
+    size_t offset = (size_t)storeHeader->tail;
+    size_t end = (size_t)storeHeader->end;
+    while (offset < end) {
+        size_t left = end - offset - sizeof(STORE_RECORD);
+        const STORE_RECORD *rec = store_record(offset);
+        if (end - offset < sizeof(STORE_RECORD) || rec->key_len > left
+            || (rec->value_len != STORE_TOMBSTONE && rec->value_len > left - rec->key_len))
+            break;
+        size_t size = store_record_size(rec);
+        if (size > end - offset || store_crc(rec) != rec->crc)
+            break;
+        if (!store_index(offset)) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return 0;
+        }
+        offset += size;
+    }
+    // pages can reach the disk out of order on power loss; drop everything after a broken record.
+    storeHeader->end = offset;
+    return 1;
+}
+
+void store_close(void) {
+    store_unmap();
+    if (storeFile) {
+        CloseHandle(storeFile);
+        storeFile = NULL;
+    }
+    strmap_clear(&storeTail, NULL);
+    storeCount = 0;
+    storeLive = 0;
+}
+
+int store_open(void) {
+    storeFile = CreateFileW(storePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (storeFile == INVALID_HANDLE_VALUE) {
+        storeFile = NULL;
+        return 0;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(storeFile, &size) || (uint64_t)size.QuadPart > SIZE_MAX
+        || !store_map(size.QuadPart ? (size_t)size.QuadPart : STORE_GROW_MIN)) {
+        store_close();
+        return 0;
+    }
+    if (!size.QuadPart) {
+        memcpy(storeHeader->magic, STORE_MAGIC, sizeof(storeHeader->magic));
+        storeHeader->version = STORE_FORMAT_VERSION;
+        storeHeader->table = storeHeader->tail = storeHeader->end = STORE_HEADER_SIZE;
+    }
+    else if (!store_valid()) {
+        // leave a file we don't understand as it is.
+        store_close();
+        SetLastError(ERROR_BAD_FORMAT);
+        return 0;
+    }
+    if (!store_replay()) {
+        store_close();
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    return 1;
+}
+
+int store_flush(void) {
+    storeDirty = 0;
+    return FlushViewOfFile(storeView, 0) && FlushFileBuffers(storeFile);
+}
+
+int store_build(const STORE_RECORD *rec, void *arg) {
+    STORE_BUILD *build = arg;
+    size_t size = store_record_size(rec);
+    memcpy(build->view + build->offset, rec, size);
+    size_t i = rec->hash & (build->slots - 1);
+    while (build->table[i])
+        i = (i + 1) & (build->slots - 1);
+    build->table[i] = build->offset;
+    build->offset += size;
+    return 1;
+}
+
+int store_compact(void) {
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    size_t slots = STORE_MIN_SLOTS;
+    while (slots < storeCount * 2)
+        slots *= 2;
+    size_t table = STORE_HEADER_SIZE + storeLive;
+    size_t tail = table + slots * sizeof(uint64_t);
+    size_t size = tail + STORE_GROW_MIN;
+    HANDLE file = CreateFileW(storeTempPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+    HANDLE mapping = NULL;
+    char *view = NULL;
+    LARGE_INTEGER distance;
+    distance.QuadPart = size;
+    if (SetFilePointerEx(file, distance, NULL, FILE_BEGIN) && SetEndOfFile(file))
+        mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    if (mapping)
+        view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+    int result = 0;
+    if (view) {
+        STORE_BUILD build;
+        build.view = view;
+        build.offset = STORE_HEADER_SIZE;
+        build.table = (uint64_t *)(view + table);
+        build.slots = slots;
+        store_foreach(store_build, &build);
+        STORE_HEADER *header = (STORE_HEADER *)view;
+        memcpy(header->magic, STORE_MAGIC, sizeof(header->magic));
+        header->version = STORE_FORMAT_VERSION;
+        header->table = table;
+        header->slots = slots;
+        header->count = storeCount;
+        header->tail = header->end = tail;
+        result = build.offset == table && FlushViewOfFile(view, 0) && FlushFileBuffers(file);
+        UnmapViewOfFile(view);
+    }
+    if (mapping)
+        CloseHandle(mapping);
+    CloseHandle(file);
+    if (!result) {
+        DeleteFileW(storeTempPath);
+        return 0;
+    }
+    store_close();
+    // the rename is the commit point; until then the old file stays as it was.
+    if (!MoveFileExW(storeTempPath, storePath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        DeleteFileW(storeTempPath);
+        result = 0;
+    }
+    if (!store_open())
+        return 0;
+    if (result) {
+        QueryPerformanceCounter(&end);
+        storeCompactions++;
+        storeCompactTotal += (end.QuadPart - start.QuadPart) * 1000000 / storeFrequency.QuadPart;
+    }
+    return result;
+}
+
+// appends a record and commits it; value NULL deletes key.
+int store_append(const char *key, size_t len, const char *value, size_t value_len) {
+    if (len >= STORE_TOMBSTONE || (value && value_len >= STORE_TOMBSTONE)) {
+        SetLastError(ERROR_FILE_TOO_LARGE);
+        return 0;
+    }
+    size_t data_len = sizeof(STORE_RECORD) + len + (value ? value_len : 0);
+    size_t size = STORE_ALIGN(data_len);
+    if (!store_reserve(size))
+        return 0;
+    size_t offset = (size_t)storeHeader->end;
+    STORE_RECORD *rec = store_record(offset);
+    rec->hash = strmap_hash(key, len);
+    rec->key_len = (uint32_t)len;
+    rec->value_len = value ? (uint32_t)value_len : STORE_TOMBSTONE;
+    memcpy(rec + 1, key, len);
+    if (value)
+        memcpy((char *)(rec + 1) + len, value, value_len);
+    memset((char *)rec + data_len, 0, size - data_len);
+    rec->crc = store_crc(rec);
+    if (!store_index(offset)) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    storeHeader->end = offset + size;
+    storeWrites++;
+    storeDirty = 1;
+    // bound the replay on load even if the ghost never goes idle.
+    if (storeHeader->end - storeHeader->tail > STORE_COMPACT_TAIL_MAX * 2)
+        store_compact();
+    return 1;
+}
+
+int LOAD_Store(const wchar_t *rootW) {
+    QueryPerformanceFrequency(&storeFrequency);
+    store_crc_init();
+    size_t path_len = wcslen(rootW) + wcslen(STORE_FILE_NAME_W);
+    storePath = calloc(path_len + 1, sizeof(wchar_t));
+    storeTempPath = calloc(path_len + wcslen(STORE_TEMP_SUFFIX_W) + 1, sizeof(wchar_t));
+    if (!storePath || !storeTempPath)
+        return 0;
+    wcscpy(storePath, rootW);
+    wcscat(storePath, STORE_FILE_NAME_W);
+    wcscpy(storeTempPath, storePath);
+    wcscat(storeTempPath, STORE_TEMP_SUFFIX_W);
+    // left behind by a compaction which did not finish.
+    DeleteFileW(storeTempPath);
+    AcquireSRWLockExclusive(&storeLock);
+    int result = store_open();
+    ReleaseSRWLockExclusive(&storeLock);
+    return result;
+}
+
+int UNLOAD_Store(void) {
+    int result = 1;
+    AcquireSRWLockExclusive(&storeLock);
+    if (storeView)
+        result = store_flush();
+    store_close();
+    ReleaseSRWLockExclusive(&storeLock);
+    free(storeTempPath);
+    storeTempPath = NULL;
+    free(storePath);
+    storePath = NULL;
+    return result;
+}
+
+void store_idle(void) {
+    AcquireSRWLockExclusive(&storeLock);
+    if (storeView) {
+        // rewriting everything pays off once the tail is large next to the live data.
+        size_t due = storeLive / 4;
+        if (due < STORE_COMPACT_TAIL)
+            due = STORE_COMPACT_TAIL;
+        if (due > STORE_COMPACT_TAIL_MAX)
+            due = STORE_COMPACT_TAIL_MAX;
+        if (storeHeader->end - storeHeader->tail >= due)
+            store_compact();
+        else if (storeDirty) {
+            // start writing pages back now rather than all at unload.
+            storeDirty = 0;
+            FlushViewOfFile(storeView, 0);
+        }
+    }
+    ReleaseSRWLockExclusive(&storeLock);
+}
+
+void store_stats(PyObject *dict) {
+    // objects are built after the lock is left; a collection there may run a finalizer writing the store.
+    AcquireSRWLockShared(&storeLock);
+    int open = storeView != NULL;
+    Py_ssize_t keys = (Py_ssize_t)storeCount;
+    unsigned long long bytes = open ? (unsigned long long)storeHeader->end : 0ULL;
+    Py_ssize_t live = (Py_ssize_t)storeLive;
+    unsigned long long tail = open ? (unsigned long long)(storeHeader->end - storeHeader->tail) : 0ULL;
+    LONG64 writes = storeWrites;
+    LONG64 compactions = storeCompactions;
+    LONG64 compact_us = storeCompactTotal;
+    ReleaseSRWLockShared(&storeLock);
+    PyObject *stats = Py_BuildValue("{s:O,s:n,s:K,s:n,s:K,s:L,s:L,s:L}",
+        "open", open ? Py_True : Py_False,
+        "keys", keys,
+        "bytes", bytes,
+        "live", live,
+        "tail", tail,
+        "writes", (long long)writes,
+        "compactions", (long long)compactions,
+        "compact_us", (long long)compact_us);
+    if (stats) {
+        PyDict_SetItemString(dict, "store", stats);
+        Py_DECREF(stats);
+    }
+}
+
+const char *store_key(PyObject *key, Py_ssize_t *len) {
+    if (!PyUnicode_Check(key)) {
+        PyErr_Format(PyExc_TypeError, "store keys must be str, not %.200s", Py_TYPE(key)->tp_name);
+        return NULL;
+    }
+    return PyUnicode_AsUTF8AndSize(key, len);
+}
+
+// copies out the pickled value of key.
+PyObject *store_read(PyObject *key) {
+    Py_ssize_t len;
+    const char *k = store_key(key, &len);
+    if (!k)
+        return NULL;
+    PyObject *result = NULL;
+    AcquireSRWLockShared(&storeLock);
+    if (!storeView)
+        PyErr_SetString(PyExc_OSError, STORE_CLOSED_MESSAGE);
+    else {
+        const STORE_RECORD *rec = store_lookup(k, len);
+        if (rec)
+            result = PyBytes_FromStringAndSize((const char *)(rec + 1) + rec->key_len, rec->value_len);
+        else
+            PyErr_SetObject(PyExc_KeyError, key);
+    }
+    ReleaseSRWLockShared(&storeLock);
+    return result;
+}
+
+// value NULL deletes key.
+int store_write(PyObject *key, PyObject *value) {
+    Py_ssize_t len;
+    const char *k = store_key(key, &len);
+    if (!k)
+        return -1;
+    PyObject *pickled = NULL;
+    if (value) {
+        pickled = PyObject_CallFunction(storeDumps, "Oi", value, STORE_PICKLE_PROTOCOL);
+        if (!pickled)
+            return -1;
+        if (!PyBytes_Check(pickled)) {
+            Py_DECREF(pickled);
+            PyErr_SetString(PyExc_TypeError, "pickle.dumps did not return bytes");
+            return -1;
+        }
+    }
+    int result = -1;
+    AcquireSRWLockExclusive(&storeLock);
+    if (!storeView)
+        PyErr_SetString(PyExc_OSError, STORE_CLOSED_MESSAGE);
+    else if (!value && !store_lookup(k, len))
+        PyErr_SetObject(PyExc_KeyError, key);
+    else if (!store_append(k, len, pickled ? PyBytes_AS_STRING(pickled) : NULL, pickled ? PyBytes_GET_SIZE(pickled) : 0))
+        PyErr_SetFromWindowsErr(0);
+    else
+        result = 0;
+    ReleaseSRWLockExclusive(&storeLock);
+    Py_XDECREF(pickled);
+    return result;
+}
+
+PyObject *store_unpickle(PyObject *pickled) {
+    PyObject *result = PyObject_CallFunctionObjArgs(storeLoads, pickled, NULL);
+    Py_DECREF(pickled);
+    return result;
+}
+
+typedef struct _STORE_LIST {
+    // records copied out of the view, with empty values unless with_values.
+    char *data;
+    size_t size;
+    int with_values;
+} STORE_LIST;
+
+// sizes the copy when list->data is NULL, then fills it.
+int store_list_copy(const STORE_RECORD *rec, void *arg) {
+    STORE_LIST *list = arg;
+    STORE_RECORD copy = *rec;
+    if (!list->with_values)
+        copy.value_len = 0;
+    size_t data_len = store_data_len(&copy);
+    if (list->data) {
+        memcpy(list->data + list->size, &copy, sizeof(STORE_RECORD));
+        memcpy(list->data + list->size + sizeof(STORE_RECORD), rec + 1, data_len);
+    }
+    list->size += store_record_size(&copy);
+    return 1;
+}
+
+// keys, or (key, pickled value) pairs.
+PyObject *store_list(int with_values) {
+    STORE_LIST list;
+    list.data = NULL;
+    list.size = 0;
+    list.with_values = with_values;
+    // copied under the lock and turned into objects after it; a collection meanwhile may write the store.
+    int result = 0;
+    AcquireSRWLockShared(&storeLock);
+    int open = storeView != NULL;
+    if (open) {
+        store_foreach(store_list_copy, &list);
+        list.data = malloc(list.size ? list.size : 1);
+        list.size = 0;
+        if (list.data)
+            result = store_foreach(store_list_copy, &list);
+    }
+    ReleaseSRWLockShared(&storeLock);
+    if (!result) {
+        free(list.data);
+        if (open)
+            PyErr_NoMemory();
+        else
+            PyErr_SetString(PyExc_OSError, STORE_CLOSED_MESSAGE);
+        return NULL;
+    }
+    PyObject *items = PyList_New(0);
+    for (size_t offset = 0; items && offset < list.size;) {
+        const STORE_RECORD *rec = (const STORE_RECORD *)(list.data + offset);
+        const char *key = (const char *)(rec + 1);
+        PyObject *item = PyUnicode_FromStringAndSize(key, rec->key_len);
+        if (item && with_values) {
+            PyObject *value = PyBytes_FromStringAndSize(key + rec->key_len, rec->value_len);
+            PyObject *pair = value ? PyTuple_Pack(2, item, value) : NULL;
+            Py_XDECREF(value);
+            Py_DECREF(item);
+            item = pair;
+        }
+        if (!item || PyList_Append(items, item) < 0)
+            Py_CLEAR(items);
+        Py_XDECREF(item);
+        offset += store_record_size(rec);
+    }
+    free(list.data);
+    return items;
+}
+
+int store_merge(PyObject *other) {
+    PyObject *items = PyObject_CallMethod(other, "items", NULL);
+    PyObject *iter = items ? PyObject_GetIter(items) : NULL;
+    Py_XDECREF(items);
+    if (!iter)
+        return -1;
+    for (PyObject *item = PyIter_Next(iter); item; item = PyIter_Next(iter)) {
+        PyObject *key, *value;
+        int result = PyArg_ParseTuple(item, "OO", &key, &value) ? store_write(key, value) : -1;
+        Py_DECREF(item);
+        if (result < 0)
+            break;
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+Py_ssize_t phiori_store_length(PyObject *self) {
+    AcquireSRWLockShared(&storeLock);
+    Py_ssize_t result = storeCount;
+    ReleaseSRWLockShared(&storeLock);
+    return result;
+}
+
+PyObject *phiori_store_subscript(PyObject *self, PyObject *key) {
+    PyObject *pickled = store_read(key);
+    return pickled ? store_unpickle(pickled) : NULL;
+}
+
+int phiori_store_ass_subscript(PyObject *self, PyObject *key, PyObject *value) {
+    return store_write(key, value);
+}
+
+int phiori_store_contains(PyObject *self, PyObject *key) {
+    Py_ssize_t len;
+    const char *k = store_key(key, &len);
+    if (!k)
+        return -1;
+    int result = -1;
+    AcquireSRWLockShared(&storeLock);
+    if (!storeView)
+        PyErr_SetString(PyExc_OSError, STORE_CLOSED_MESSAGE);
+    else
+        result = store_lookup(k, len) != NULL;
+    ReleaseSRWLockShared(&storeLock);
+    return result;
+}
+
+PyObject *phiori_store_iter(PyObject *self) {
+    PyObject *keys = store_list(0);
+    if (!keys)
+        return NULL;
+    PyObject *result = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+    return result;
+}
+
+PyObject *phiori_store_get(PyObject *self, PyObject *args) {
+    PyObject *key, *def = Py_None;
+    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &def))
+        return NULL;
+    PyObject *pickled = store_read(key);
+    if (pickled)
+        return store_unpickle(pickled);
+    if (!PyErr_ExceptionMatches(PyExc_KeyError))
+        return NULL;
+    PyErr_Clear();
+    Py_INCREF(def);
+    return def;
+}
+
+PyObject *phiori_store_setdefault(PyObject *self, PyObject *args) {
+    PyObject *key, *def = Py_None;
+    if (!PyArg_UnpackTuple(args, "setdefault", 1, 2, &key, &def))
+        return NULL;
+    PyObject *pickled = store_read(key);
+    if (pickled)
+        return store_unpickle(pickled);
+    if (!PyErr_ExceptionMatches(PyExc_KeyError))
+        return NULL;
+    PyErr_Clear();
+    if (store_write(key, def) < 0)
+        return NULL;
+    Py_INCREF(def);
+    return def;
+}
+
+PyObject *phiori_store_pop(PyObject *self, PyObject *args) {
+    PyObject *key, *def = NULL;
+    if (!PyArg_UnpackTuple(args, "pop", 1, 2, &key, &def))
+        return NULL;
+    PyObject *pickled = store_read(key);
+    if (!pickled) {
+        if (!def || !PyErr_ExceptionMatches(PyExc_KeyError))
+            return NULL;
+        PyErr_Clear();
+        Py_INCREF(def);
+        return def;
+    }
+    if (store_write(key, NULL) < 0) {
+        Py_DECREF(pickled);
+        return NULL;
+    }
+    return store_unpickle(pickled);
+}
+
+PyObject *phiori_store_keys(PyObject *self, PyObject *args) {
+    return store_list(0);
+}
+
+PyObject *phiori_store_items(PyObject *self, PyObject *args) {
+    PyObject *result = store_list(1);
+    if (!result)
+        return NULL;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(result); i++) {
+        PyObject *pair = PyList_GET_ITEM(result, i);
+        PyObject *value = PyObject_CallFunctionObjArgs(storeLoads, PyTuple_GET_ITEM(pair, 1), NULL);
+        PyObject *item = value ? PyTuple_Pack(2, PyTuple_GET_ITEM(pair, 0), value) : NULL;
+        Py_XDECREF(value);
+        if (!item) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SetItem(result, i, item);
+    }
+    return result;
+}
+
+PyObject *phiori_store_values(PyObject *self, PyObject *args) {
+    PyObject *result = store_list(1);
+    if (!result)
+        return NULL;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(result); i++) {
+        PyObject *pair = PyList_GET_ITEM(result, i);
+        PyObject *value = PyObject_CallFunctionObjArgs(storeLoads, PyTuple_GET_ITEM(pair, 1), NULL);
+        if (!value) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SetItem(result, i, value);
+    }
+    return result;
+}
+
+PyObject *phiori_store_update(PyObject *self, PyObject *args, PyObject *kwargs) {
+    PyObject *other = NULL;
+    if (!PyArg_UnpackTuple(args, "update", 0, 1, &other))
+        return NULL;
+    if (other && store_merge(other) < 0)
+        return NULL;
+    if (kwargs && store_merge(kwargs) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyObject *phiori_store_clear(PyObject *self, PyObject *args) {
+    PyObject *keys = store_list(0);
+    if (!keys)
+        return NULL;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(keys); i++)
+        if (store_write(PyList_GET_ITEM(keys, i), NULL) < 0) {
+            Py_DECREF(keys);
+            return NULL;
+        }
+    Py_DECREF(keys);
+    Py_RETURN_NONE;
+}
+
+PyObject *phiori_store_sync(PyObject *self, PyObject *args) {
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    AcquireSRWLockExclusive(&storeLock);
+    result = storeView ? store_flush() : -1;
+    ReleaseSRWLockExclusive(&storeLock);
+    Py_END_ALLOW_THREADS
+    if (result < 0)
+        PyErr_SetString(PyExc_OSError, STORE_CLOSED_MESSAGE);
+    else if (!result)
+        PyErr_SetFromWindowsErr(0);
+    if (result <= 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyObject *phiori_store_compact(PyObject *self, PyObject *args) {
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    AcquireSRWLockExclusive(&storeLock);
+    result = storeView ? store_compact() : -1;
+    ReleaseSRWLockExclusive(&storeLock);
+    Py_END_ALLOW_THREADS
+    if (result < 0)
+        PyErr_SetString(PyExc_OSError, STORE_CLOSED_MESSAGE);
+    else if (!result)
+        PyErr_SetFromWindowsErr(0);
+    if (result <= 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyMappingMethods phioriStoreAsMapping = {
+    phiori_store_length,
+    phiori_store_subscript,
+    phiori_store_ass_subscript
+};
+
+PySequenceMethods phioriStoreAsSequence = {
+    .sq_contains = phiori_store_contains
+};
+
+PyMethodDef phioriStoreMethods[] = {
+    {"get", phiori_store_get, METH_VARARGS,
+        "get(key, default=None)"},
+    {"setdefault", phiori_store_setdefault, METH_VARARGS,
+        "setdefault(key, default=None)"},
+    {"pop", phiori_store_pop, METH_VARARGS,
+        "pop(key[, default])"},
+    {"keys", phiori_store_keys, METH_NOARGS,
+        "keys() -> list"},
+    {"items", phiori_store_items, METH_NOARGS,
+        "items() -> list"},
+    {"values", phiori_store_values, METH_NOARGS,
+        "values() -> list"},
+    {"update", (PyCFunction)phiori_store_update, METH_VARARGS | METH_KEYWORDS,
+        "update(mapping=None, **kwargs)"},
+    {"clear", phiori_store_clear, METH_NOARGS,
+        "clear()"},
+    {"sync", phiori_store_sync, METH_NOARGS,
+        "sync()\n\nWait until every write so far is on disk. Without it, writes survive a crash of the process\n"
+        "but not necessarily of the machine."},
+    {"compact", phiori_store_compact, METH_NOARGS,
+        "compact()\n\nRewrite the store without overwritten and deleted values. Done in idle gaps anyway."},
+    {NULL, NULL, 0, NULL}
+};
+
+PyTypeObject phioriStoreType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = PHIORI_MODULE_NAME ".Store",
+    .tp_basicsize = sizeof(StoreObject),
+    .tp_as_sequence = &phioriStoreAsSequence,
+    .tp_as_mapping = &phioriStoreAsMapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Persistent mapping of str keys to picklable values, kept in phiori.store of the ghost.\n\n"
+        "Every assignment and deletion is written through to a memory-mapped log as it happens.",
+    .tp_iter = phiori_store_iter,
+    .tp_methods = phioriStoreMethods
+};
+
+int store_init_module(PyObject *module) {
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (!pickle)
+        return 0;
+    storeDumps = PyObject_GetAttrString(pickle, "dumps");
+    storeLoads = PyObject_GetAttrString(pickle, "loads");
+    Py_DECREF(pickle);
+    if (!storeDumps || !storeLoads || PyType_Ready(&phioriStoreType) < 0)
+        return 0;
+    PyObject *store = PyType_GenericAlloc(&phioriStoreType, 0);
+    if (!store)
+        return 0;
+    return PyModule_AddObject(module, "store", store) == 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _PHIORI_STORE
+#define _PHIORI_STORE 1
+#include <wchar.h>
+#include <Python.h>
+
+#define STORE_FILE_NAME_W L"phiori.store"
+#define STORE_TEMP_SUFFIX_W L".tmp"
+// the log appended since the last compaction is replayed on load; compaction keeps it within these.
+#define STORE_COMPACT_TAIL (256 * 1024)
+#define STORE_COMPACT_TAIL_MAX (8 * 1024 * 1024)
+
+int LOAD_Store(const wchar_t *rootW);
+int UNLOAD_Store(void);
+int store_init_module(PyObject *module);
+// called without the GIL in idle gaps; flushes and compacts when due.
+void store_idle(void);
+void store_stats(PyObject *dict);
+
+#endif
@@ -0,0 +1,107 @@
+#include "strmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STRMAP_INITIAL_CAPACITY 16
+
+uint32_t strmap_hash(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+STRMAP_ENTRY *strmap_get(const STRMAP *map, const char *key, size_t len) {
+    if (!map->count)
+        return NULL;
+    uint32_t hash = strmap_hash(key, len);
+    for (STRMAP_ENTRY *entry = map->buckets[hash & (map->capacity - 1)]; entry; entry = entry->next)
+        if (entry->hash == hash && entry->len == len && memcmp(entry->key, key, len) == 0)
+            return entry;
+    return NULL;
+}
+
+int strmap_grow(STRMAP *map) {
+    size_t capacity = map->capacity ? map->capacity * 2 : STRMAP_INITIAL_CAPACITY;
+    STRMAP_ENTRY **buckets = calloc(capacity, sizeof(STRMAP_ENTRY *));
+    if (!buckets)
+        return 0;
+    for (size_t i = 0; i < map->capacity; i++) {
+        STRMAP_ENTRY *entry = map->buckets[i];
+        while (entry) {
+            STRMAP_ENTRY *next = entry->next;
+            entry->next = buckets[entry->hash & (capacity - 1)];
+            buckets[entry->hash & (capacity - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(map->buckets);
+    map->buckets = buckets;
+    map->capacity = capacity;
+    return 1;
+}
+
+STRMAP_ENTRY *strmap_put(STRMAP *map, const char *key, size_t len) {
+    STRMAP_ENTRY *entry = strmap_get(map, key, len);
+    if (entry)
+        return entry;
+    // keep load factor under 3/4.
+    if ((map->count + 1) * 4 > map->capacity * 3 && !strmap_grow(map))
+        return NULL;
+    entry = calloc(1, sizeof(STRMAP_ENTRY));
+    if (!entry)
+        return NULL;
+    entry->key = malloc(len + 1);
+    if (!entry->key) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->key, key, len);
+    entry->key[len] = '\0';
+    entry->len = len;
+    entry->hash = strmap_hash(key, len);
+    entry->next = map->buckets[entry->hash & (map->capacity - 1)];
+    map->buckets[entry->hash & (map->capacity - 1)] = entry;
+    map->count++;
+    return entry;
+}
+
+int strmap_remove(STRMAP *map, const char *key, size_t len, void **value) {
+    if (!map->count)
+        return 0;
+    uint32_t hash = strmap_hash(key, len);
+    STRMAP_ENTRY **link = &map->buckets[hash & (map->capacity - 1)];
+    for (; *link; link = &(*link)->next) {
+        STRMAP_ENTRY *entry = *link;
+        if (entry->hash == hash && entry->len == len && memcmp(entry->key, key, len) == 0) {
+            *link = entry->next;
+            if (value)
+                *value = entry->value;
+            free(entry->key);
+            free(entry);
+            map->count--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void strmap_clear(STRMAP *map, void (*free_value)(void *)) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        STRMAP_ENTRY *entry = map->buckets[i];
+        while (entry) {
+            STRMAP_ENTRY *next = entry->next;
+            if (free_value)
+                free_value(entry->value);
+            free(entry->key);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(map->buckets);
+    map->buckets = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
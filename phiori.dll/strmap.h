@@ -0,0 +1,32 @@
+#ifndef _PHIORI_STRMAP
+#define _PHIORI_STRMAP 1
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _STRMAP_ENTRY {
+    char *key;
+    size_t len;
+    uint32_t hash;
+    void *value;
+    struct _STRMAP_ENTRY *next;
+} STRMAP_ENTRY;
+
+typedef struct _STRMAP {
+    STRMAP_ENTRY **buckets;
+    size_t capacity;
+    size_t count;
+} STRMAP;
+
+// 32-bit FNV-1a.
+uint32_t strmap_hash(const char *key, size_t len);
+STRMAP_ENTRY *strmap_get(const STRMAP *map, const char *key, size_t len);
+// returns the existing entry or a new one with a NULL value.
+STRMAP_ENTRY *strmap_put(STRMAP *map, const char *key, size_t len);
+int strmap_remove(STRMAP *map, const char *key, size_t len, void **value);
+void strmap_clear(STRMAP *map, void (*free_value)(void *));
+
+#define STRMAP_FOREACH(map, entry) \
+    for (size_t _b = 0; _b < (map).capacity; _b++) \
+        for (STRMAP_ENTRY *entry = (map).buckets[_b]; entry; entry = entry->next)
+
+#endif
@@ -0,0 +1,569 @@
+#include "module.h"
+#include "template.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include <Python.h>
+#include <structmember.h>
+
+/*
+ * Template syntax:
+ *
+ * {name}       value of name, with \ and % escaped for SakuraScript
+ * {name!r}     value of name as it is
+ * {a|b|c}      one of the alternatives at random; each is a template itself
+ * {{ and }}    literal braces, outside groups
+ *
+ * Compiled code is a flat array of words:
+ *
+ * TEMPLATE_TEXT literal             append literals[literal]
+ * TEMPLATE_SLOT name flags          append the value of names[name]
+ * TEMPLATE_CHOICE table             jump to a random entry of the table
+ * TEMPLATE_JUMP pc
+ *
+ * A choice is laid out as its alternatives, each ending with a jump past
+ * the table, followed by the table itself: count, then the start of each.
+ */
+
+#define TEMPLATE_TEXT 0
+#define TEMPLATE_SLOT 1
+#define TEMPLATE_CHOICE 2
+#define TEMPLATE_JUMP 3
+
+#define TEMPLATE_ESCAPE 1
+
+#define TEMPLATE_PIECES_INITIAL 32
+
+typedef struct _TemplateObject {
+    PyObject_HEAD
+    PyObject *source;
+    uint32_t *code;
+    size_t code_len;
+    PyObject *literals;
+    PyObject *names;
+} TemplateObject;
+
+typedef struct _TEMPLATE_COMPILER {
+    PyObject *source;
+    int kind;
+    void *data;
+    Py_ssize_t len;
+    Py_ssize_t pos;
+    uint32_t *code;
+    size_t code_len;
+    size_t code_capacity;
+    PyObject *literals;
+    PyObject *names;
+    // text not emitted yet, so that adjacent runs become one literal.
+    PyObject *text;
+} TEMPLATE_COMPILER;
+
+typedef struct _TEMPLATE_PIECE {
+    PyObject *value;
+    int escape;
+    // escapable characters in value, when escaping.
+    Py_ssize_t escapes;
+} TEMPLATE_PIECE;
+
+typedef struct _TEMPLATE_RENDER {
+    TEMPLATE_PIECE *pieces;
+    size_t count;
+    size_t capacity;
+    TEMPLATE_PIECE initial[TEMPLATE_PIECES_INITIAL];
+} TEMPLATE_RENDER;
+
+uint64_t templateRandom;
+LARGE_INTEGER templateFrequency;
+LONG64 templateCompiled;
+LONG64 templateRenders;
+LONG64 templateRenderTicks;
+
+uint32_t template_random(uint32_t n) {
+    // xorshift64*
+    templateRandom ^= templateRandom >> 12;
+    templateRandom ^= templateRandom << 25;
+    templateRandom ^= templateRandom >> 27;
+    return (uint32_t)((templateRandom * 2685821657736338717ULL) >> 32) % n;
+}
+
+int template_is_escaped(Py_UCS4 ch) {
+    return ch == '\\' || ch == '%';
+}
+
+int template_emit(TEMPLATE_COMPILER *c, uint32_t word) {
+    if (c->code_len == c->code_capacity) {
+        size_t capacity = c->code_capacity ? c->code_capacity * 2 : 16;
+        uint32_t *code = realloc(c->code, capacity * sizeof(uint32_t));
+        if (!code) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        c->code = code;
+        c->code_capacity = capacity;
+    }
+    c->code[c->code_len++] = word;
+    return 1;
+}
+
+int template_add_text(TEMPLATE_COMPILER *c, Py_ssize_t start, Py_ssize_t end) {
+    PyObject *text = PyUnicode_Substring(c->source, start, end);
+    if (!text)
+        return 0;
+    if (c->text) {
+        PyUnicode_Append(&c->text, text);
+        Py_DECREF(text);
+        return c->text != NULL;
+    }
+    c->text = text;
+    return 1;
+}
+
+int template_flush_text(TEMPLATE_COMPILER *c) {
+    if (!c->text)
+        return 1;
+    int result = PyList_Append(c->literals, c->text) == 0
+        && template_emit(c, TEMPLATE_TEXT)
+        && template_emit(c, (uint32_t)(PyList_GET_SIZE(c->literals) - 1));
+    Py_CLEAR(c->text);
+    return result;
+}
+
+int template_error(TEMPLATE_COMPILER *c, const char *message) {
+    PyErr_Format(PyExc_ValueError, "%s at position %zd of template", message, c->pos);
+    return 0;
+}
+
+int template_parse_group(TEMPLATE_COMPILER *c, int depth);
+
+// stops before a '|' or '}' closing the group at depth, or at the end.
+int template_parse_sequence(TEMPLATE_COMPILER *c, int depth) {
+    while (c->pos < c->len) {
+        Py_UCS4 ch = PyUnicode_READ(c->kind, c->data, c->pos);
+        Py_UCS4 next = c->pos + 1 < c->len ? PyUnicode_READ(c->kind, c->data, c->pos + 1) : 0;
+        if (ch == '{') {
+            if (!depth && next == '{') {
+                if (!template_add_text(c, c->pos, c->pos + 1))
+                    return 0;
+                c->pos += 2;
+                continue;
+            }
+            c->pos++;
+            if (!template_flush_text(c) || !template_parse_group(c, depth + 1))
+                return 0;
+        }
+        else if (ch == '}') {
+            if (depth)
+                return template_flush_text(c);
+            if (next != '}')
+                return template_error(c, "single '}'");
+            if (!template_add_text(c, c->pos, c->pos + 1))
+                return 0;
+            c->pos += 2;
+        }
+        else if (ch == '|' && depth)
+            return template_flush_text(c);
+        else {
+            Py_ssize_t start = c->pos;
+            while (c->pos < c->len) {
+                ch = PyUnicode_READ(c->kind, c->data, c->pos);
+                if (ch == '{' || ch == '}' || (ch == '|' && depth))
+                    break;
+                c->pos++;
+            }
+            if (!template_add_text(c, start, c->pos))
+                return 0;
+        }
+    }
+    if (depth)
+        return template_error(c, "unterminated '{'");
+    return template_flush_text(c);
+}
+
+// a group without alternatives names a slot: name or name!r.
+int template_parse_slot(TEMPLATE_COMPILER *c, Py_ssize_t start, Py_ssize_t end) {
+    uint32_t flags = TEMPLATE_ESCAPE;
+    Py_ssize_t bang = PyUnicode_FindChar(c->source, '!', start, end, 1);
+    if (bang == -2)
+        return 0;
+    if (bang >= 0) {
+        Py_UCS4 conversion = bang + 2 == end ? PyUnicode_READ(c->kind, c->data, bang + 1) : 0;
+        if (conversion == 'r')
+            flags &= ~TEMPLATE_ESCAPE;
+        else if (conversion != 'e')
+            return template_error(c, "unknown conversion in slot");
+        end = bang;
+    }
+    PyObject *name = PyUnicode_Substring(c->source, start, end);
+    if (!name)
+        return 0;
+    if (!PyUnicode_IsIdentifier(name)) {
+        Py_DECREF(name);
+        return template_error(c, "invalid slot name");
+    }
+    int result = PyList_Append(c->names, name) == 0
+        && template_emit(c, TEMPLATE_SLOT)
+        && template_emit(c, (uint32_t)(PyList_GET_SIZE(c->names) - 1))
+        && template_emit(c, flags);
+    Py_DECREF(name);
+    return result;
+}
+
+// called after the opening '{'.
+int template_parse_group(TEMPLATE_COMPILER *c, int depth) {
+    Py_ssize_t start = c->pos;
+    size_t code_start = c->code_len;
+    Py_ssize_t literals_start = PyList_GET_SIZE(c->literals);
+    if (!template_emit(c, TEMPLATE_CHOICE) || !template_emit(c, 0))
+        return 0;
+    size_t count = 0, capacity = 4;
+    // pc of each alternative, then the jump operand it ends with.
+    size_t *alternatives = malloc(capacity * 2 * sizeof(size_t));
+    if (!alternatives) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    int result = 0;
+    for (;;) {
+        if (count == capacity) {
+            size_t *alternatives_t = realloc(alternatives, capacity * 4 * sizeof(size_t));
+            if (!alternatives_t) {
+                PyErr_NoMemory();
+                break;
+            }
+            alternatives = alternatives_t;
+            capacity *= 2;
+        }
+        alternatives[count * 2] = c->code_len;
+        if (!template_parse_sequence(c, depth))
+            break;
+        Py_UCS4 ch = PyUnicode_READ(c->kind, c->data, c->pos);
+        if (ch == '}' && !count) {
+            // no '|': this was a slot after all.
+            c->code_len = code_start;
+            if (PyList_SetSlice(c->literals, literals_start, PyList_GET_SIZE(c->literals), NULL) < 0)
+                break;
+            result = template_parse_slot(c, start, c->pos);
+            c->pos++;
+            break;
+        }
+        if (!template_emit(c, TEMPLATE_JUMP) || !template_emit(c, 0))
+            break;
+        alternatives[count * 2 + 1] = c->code_len - 1;
+        count++;
+        c->pos++;
+        if (ch == '}') {
+            size_t table = c->code_len;
+            result = template_emit(c, (uint32_t)count);
+            for (size_t i = 0; result && i < count; i++)
+                result = template_emit(c, (uint32_t)alternatives[i * 2]);
+            if (result) {
+                c->code[code_start + 1] = (uint32_t)table;
+                for (size_t i = 0; i < count; i++)
+                    c->code[alternatives[i * 2 + 1]] = (uint32_t)c->code_len;
+            }
+            break;
+        }
+    }
+    free(alternatives);
+    return result;
+}
+
+int template_compile(TemplateObject *self, PyObject *source) {
+    if (PyUnicode_READY(source) < 0)
+        return 0;
+    TEMPLATE_COMPILER c;
+    memset(&c, 0, sizeof(c));
+    c.source = source;
+    c.kind = PyUnicode_KIND(source);
+    c.data = PyUnicode_DATA(source);
+    c.len = PyUnicode_GET_LENGTH(source);
+    c.literals = PyList_New(0);
+    c.names = PyList_New(0);
+    int result = c.literals && c.names && template_parse_sequence(&c, 0);
+    if (result) {
+        self->literals = PyList_AsTuple(c.literals);
+        self->names = PyList_AsTuple(c.names);
+        result = self->literals && self->names;
+    }
+    if (result) {
+        self->code = c.code;
+        self->code_len = c.code_len;
+        c.code = NULL;
+    }
+    free(c.code);
+    Py_XDECREF(c.text);
+    Py_XDECREF(c.names);
+    Py_XDECREF(c.literals);
+    return result;
+}
+
+int template_add_piece(TEMPLATE_RENDER *r, PyObject *value, int escape) {
+    if (r->count == r->capacity) {
+        size_t capacity = r->capacity * 2;
+        TEMPLATE_PIECE *pieces = r->pieces == r->initial ? malloc(capacity * sizeof(TEMPLATE_PIECE))
+            : realloc(r->pieces, capacity * sizeof(TEMPLATE_PIECE));
+        if (!pieces) {
+            Py_DECREF(value);
+            PyErr_NoMemory();
+            return 0;
+        }
+        if (r->pieces == r->initial)
+            memcpy(pieces, r->initial, sizeof(r->initial));
+        r->pieces = pieces;
+        r->capacity = capacity;
+    }
+    r->pieces[r->count].value = value;
+    r->pieces[r->count].escape = escape;
+    r->pieces[r->count].escapes = 0;
+    r->count++;
+    return 1;
+}
+
+void template_render_clear(TEMPLATE_RENDER *r) {
+    for (size_t i = 0; i < r->count; i++)
+        Py_DECREF(r->pieces[i].value);
+    if (r->pieces != r->initial)
+        free(r->pieces);
+}
+
+// runs the code and collects what to join, values converted to str.
+int template_collect(TemplateObject *self, PyObject *mapping, PyObject *kwargs, TEMPLATE_RENDER *r) {
+    size_t pc = 0;
+    while (pc < self->code_len) {
+        uint32_t *op = self->code + pc;
+        if (op[0] == TEMPLATE_TEXT) {
+            PyObject *literal = PyTuple_GET_ITEM(self->literals, op[1]);
+            Py_INCREF(literal);
+            if (!template_add_piece(r, literal, 0))
+                return 0;
+            pc += 2;
+        }
+        else if (op[0] == TEMPLATE_SLOT) {
+            PyObject *name = PyTuple_GET_ITEM(self->names, op[1]);
+            PyObject *value = kwargs ? PyDict_GetItemWithError(kwargs, name) : NULL;
+            if (value)
+                Py_INCREF(value);
+            else if (PyErr_Occurred())
+                return 0;
+            else if (mapping)
+                value = PyObject_GetItem(mapping, name);
+            else
+                PyErr_SetObject(PyExc_KeyError, name);
+            if (!value)
+                return 0;
+            if (!PyUnicode_CheckExact(value)) {
+                PyObject *str = PyObject_Str(value);
+                Py_DECREF(value);
+                if (!str)
+                    return 0;
+                value = str;
+            }
+            if (PyUnicode_READY(value) < 0) {
+                Py_DECREF(value);
+                return 0;
+            }
+            if (!template_add_piece(r, value, op[2] & TEMPLATE_ESCAPE))
+                return 0;
+            pc += 3;
+        }
+        else if (op[0] == TEMPLATE_CHOICE) {
+            uint32_t *table = self->code + op[1];
+            pc = table[1 + template_random(table[0])];
+        }
+        else
+            pc = op[1];
+    }
+    return 1;
+}
+
+PyObject *template_join(TEMPLATE_RENDER *r) {
+    Py_ssize_t len = 0;
+    Py_UCS4 maxchar = 0;
+    for (size_t i = 0; i < r->count; i++) {
+        TEMPLATE_PIECE *piece = &r->pieces[i];
+        Py_ssize_t piece_len = PyUnicode_GET_LENGTH(piece->value);
+        if (piece->escape) {
+            int kind = PyUnicode_KIND(piece->value);
+            void *data = PyUnicode_DATA(piece->value);
+            for (Py_ssize_t j = 0; j < piece_len; j++)
+                if (template_is_escaped(PyUnicode_READ(kind, data, j)))
+                    piece->escapes++;
+        }
+        len += piece_len + piece->escapes;
+        if (PyUnicode_MAX_CHAR_VALUE(piece->value) > maxchar)
+            maxchar = PyUnicode_MAX_CHAR_VALUE(piece->value);
+    }
+    PyObject *result = PyUnicode_New(len, maxchar);
+    if (!result)
+        return NULL;
+    int kind = PyUnicode_KIND(result);
+    void *data = PyUnicode_DATA(result);
+    Py_ssize_t pos = 0;
+    for (size_t i = 0; i < r->count; i++) {
+        TEMPLATE_PIECE *piece = &r->pieces[i];
+        Py_ssize_t piece_len = PyUnicode_GET_LENGTH(piece->value);
+        if (!piece->escapes) {
+            if (PyUnicode_CopyCharacters(result, pos, piece->value, 0, piece_len) < 0) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            pos += piece_len;
+            continue;
+        }
+        int piece_kind = PyUnicode_KIND(piece->value);
+        void *piece_data = PyUnicode_DATA(piece->value);
+        for (Py_ssize_t j = 0; j < piece_len; j++) {
+            Py_UCS4 ch = PyUnicode_READ(piece_kind, piece_data, j);
+            if (template_is_escaped(ch))
+                PyUnicode_WRITE(kind, data, pos++, '\\');
+            PyUnicode_WRITE(kind, data, pos++, ch);
+        }
+    }
+    return result;
+}
+
+PyObject *template_join_bytes(TEMPLATE_RENDER *r) {
+    Py_ssize_t len = 0;
+    for (size_t i = 0; i < r->count; i++) {
+        TEMPLATE_PIECE *piece = &r->pieces[i];
+        Py_ssize_t piece_len;
+        const char *s = PyUnicode_AsUTF8AndSize(piece->value, &piece_len);
+        if (!s)
+            return NULL;
+        if (piece->escape)
+            for (Py_ssize_t j = 0; j < piece_len; j++)
+                if (template_is_escaped((unsigned char)s[j]))
+                    piece->escapes++;
+        len += piece_len + piece->escapes;
+    }
+    PyObject *result = PyBytes_FromStringAndSize(NULL, len);
+    if (!result)
+        return NULL;
+    char *p = PyBytes_AS_STRING(result);
+    for (size_t i = 0; i < r->count; i++) {
+        TEMPLATE_PIECE *piece = &r->pieces[i];
+        Py_ssize_t piece_len;
+        const char *s = PyUnicode_AsUTF8AndSize(piece->value, &piece_len);
+        if (!piece->escapes) {
+            memcpy(p, s, piece_len);
+            p += piece_len;
+            continue;
+        }
+        for (Py_ssize_t j = 0; j < piece_len; j++) {
+            if (template_is_escaped((unsigned char)s[j]))
+                *p++ = '\\';
+            *p++ = s[j];
+        }
+    }
+    return result;
+}
+
+PyObject *template_render(TemplateObject *self, PyObject *args, PyObject *kwargs, PyObject *(*join)(TEMPLATE_RENDER *)) {
+    PyObject *mapping = NULL;
+    if (!PyArg_UnpackTuple(args, "render", 0, 1, &mapping))
+        return NULL;
+    if (mapping == Py_None)
+        mapping = NULL;
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    TEMPLATE_RENDER r;
+    r.pieces = r.initial;
+    r.count = 0;
+    r.capacity = TEMPLATE_PIECES_INITIAL;
+    PyObject *result = template_collect(self, mapping, kwargs, &r) ? join(&r) : NULL;
+    template_render_clear(&r);
+    QueryPerformanceCounter(&end);
+    templateRenders++;
+    templateRenderTicks += end.QuadPart - start.QuadPart;
+    return result;
+}
+
+PyObject *phiori_template_render(TemplateObject *self, PyObject *args, PyObject *kwargs) {
+    return template_render(self, args, kwargs, template_join);
+}
+
+PyObject *phiori_template_render_bytes(TemplateObject *self, PyObject *args, PyObject *kwargs) {
+    return template_render(self, args, kwargs, template_join_bytes);
+}
+
+PyObject *phiori_template_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"source", NULL};
+    PyObject *source;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U:Template", keywords, &source))
+        return NULL;
+    TemplateObject *self = (TemplateObject *)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    Py_INCREF(source);
+    self->source = source;
+    if (!template_compile(self, source)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    templateCompiled++;
+    return (PyObject *)self;
+}
+
+void phiori_template_dealloc(TemplateObject *self) {
+    free(self->code);
+    Py_XDECREF(self->names);
+    Py_XDECREF(self->literals);
+    Py_XDECREF(self->source);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyObject *phiori_template_repr(TemplateObject *self) {
+    return PyUnicode_FromFormat("%s(%R)", Py_TYPE(self)->tp_name, self->source);
+}
+
+void template_stats(PyObject *dict) {
+    PyObject *stats = Py_BuildValue("{s:L,s:L,s:L}",
+        "compiled", (long long)templateCompiled,
+        "renders", (long long)templateRenders,
+        "render_us", (long long)(templateFrequency.QuadPart ? templateRenderTicks * 1000000 / templateFrequency.QuadPart : 0));
+    if (stats) {
+        PyDict_SetItemString(dict, "template", stats);
+        Py_DECREF(stats);
+    }
+}
+
+PyMethodDef phioriTemplateMethods[] = {
+    {"render", (PyCFunction)phiori_template_render, METH_VARARGS | METH_KEYWORDS,
+        "render(mapping=None, **values) -> str\n\nFill in the slots from values, then mapping, picking one alternative of each group."},
+    {"render_bytes", (PyCFunction)phiori_template_render_bytes, METH_VARARGS | METH_KEYWORDS,
+        "render_bytes(mapping=None, **values) -> bytes\n\nAs render(), encoded in UTF-8 for a response body."},
+    {NULL, NULL, 0, NULL}
+};
+
+PyMemberDef phioriTemplateMembers[] = {
+    {"source", T_OBJECT, offsetof(TemplateObject, source), READONLY, NULL},
+    {NULL, 0, 0, 0, NULL}
+};
+
+PyTypeObject phioriTemplateType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = PHIORI_MODULE_NAME ".Template",
+    .tp_basicsize = sizeof(TemplateObject),
+    .tp_dealloc = (destructor)phiori_template_dealloc,
+    .tp_repr = (reprfunc)phiori_template_repr,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Template(source)\n\nSakuraScript template compiled once. {name} inserts a value with \\ and % escaped,\n"
+        "{name!r} inserts it as it is, {a|b|c} picks one alternative at random, and {{ }} are literal braces.",
+    .tp_methods = phioriTemplateMethods,
+    .tp_members = phioriTemplateMembers,
+    .tp_new = phiori_template_new
+};
+
+int template_init_module(PyObject *module) {
+    LARGE_INTEGER seed;
+    QueryPerformanceFrequency(&templateFrequency);
+    QueryPerformanceCounter(&seed);
+    templateRandom = (uint64_t)seed.QuadPart ^ ((uint64_t)GetCurrentThreadId() << 32) ^ 0x9E3779B97F4A7C15ULL;
+    if (!templateRandom)
+        templateRandom = 1;
+    if (PyType_Ready(&phioriTemplateType) < 0)
+        return 0;
+    Py_INCREF(&phioriTemplateType);
+    return PyModule_AddObject(module, "Template", (PyObject *)&phioriTemplateType) == 0;
+}
@@ -0,0 +1,8 @@
+#ifndef _PHIORI_TEMPLATE
+#define _PHIORI_TEMPLATE 1
+#include <Python.h>
+
+int template_init_module(PyObject *module);
+void template_stats(PyObject *dict);
+
+#endif
@@ -0,0 +1,265 @@
+#include "log.h"
+#include "module.h"
+#include "strmap.h"
+#include "watchdog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include <Python.h>
+
+typedef struct _WATCHDOG_EVENT {
+    int has_budget;
+    DWORD budget;
+    LONG64 count;
+    LONG64 total_us;
+    LONG64 overruns;
+    DWORD max_ms;
+} WATCHDOG_EVENT;
+
+PyObject *RequestTimeoutError;
+
+STRMAP watchdogEvents;
+CRITICAL_SECTION watchdogLock;
+HANDLE watchdogThread;
+HANDLE watchdogWake;
+volatile int watchdogStop;
+DWORD watchdogDefaultBudget;
+LARGE_INTEGER watchdogFrequency;
+LONG64 watchdogRequests;
+LONG64 watchdogOverruns;
+LONG64 watchdogTotalUs;
+
+// state of the request in flight.
+WATCHDOG_EVENT *watchdogCurrent;
+char *watchdogCurrentId;
+LONG watchdogGeneration;
+int watchdogArmed;
+int watchdogFired;
+ULONGLONG watchdogDeadline;
+LARGE_INTEGER watchdogStart;
+
+int watchdog_interrupt(void *arg) {
+    // runs on the main thread between bytecodes, with the GIL held.
+    // once UNLOAD has begun, the lock may be gone; late calls do nothing.
+    if (watchdogStop)
+        return 0;
+    int result = 0;
+    EnterCriticalSection(&watchdogLock);
+    if (watchdogArmed && watchdogGeneration == (LONG)(intptr_t)arg) {
+        PyErr_SetString(RequestTimeoutError, REQUEST_TIMEOUT_MESSAGE);
+        result = -1;
+    }
+    LeaveCriticalSection(&watchdogLock);
+    return result;
+}
+
+DWORD WINAPI watchdog_main(LPVOID param) {
+    for (;;) {
+        DWORD wait = INFINITE;
+        EnterCriticalSection(&watchdogLock);
+        if (watchdogStop) {
+            LeaveCriticalSection(&watchdogLock);
+            break;
+        }
+        if (watchdogArmed && !watchdogFired) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= watchdogDeadline) {
+                if (Py_AddPendingCall(watchdog_interrupt, (void *)(intptr_t)watchdogGeneration) == 0)
+                    watchdogFired = 1;
+                else
+                    wait = WATCHDOG_RETRY_INTERVAL;
+            }
+            else
+                wait = (DWORD)(watchdogDeadline - now);
+        }
+        LeaveCriticalSection(&watchdogLock);
+        WaitForSingleObject(watchdogWake, wait);
+    }
+    return 0;
+}
+
+int LOAD_Watchdog(void) {
+    InitializeCriticalSection(&watchdogLock);
+    QueryPerformanceFrequency(&watchdogFrequency);
+    watchdogDefaultBudget = WATCHDOG_DEFAULT_BUDGET;
+    watchdogStop = 0;
+    watchdogArmed = 0;
+    watchdogWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!watchdogWake)
+        return 0;
+    watchdogThread = CreateThread(NULL, 0, watchdog_main, NULL, 0, NULL);
+    return watchdogThread != NULL;
+}
+
+int UNLOAD_Watchdog(void) {
+    // also turns away interrupts still queued, which run in phiori.unload() or Py_Finalize().
+    EnterCriticalSection(&watchdogLock);
+    watchdogStop = 1;
+    watchdogArmed = 0;
+    LeaveCriticalSection(&watchdogLock);
+    if (watchdogThread) {
+        SetEvent(watchdogWake);
+        WaitForSingleObject(watchdogThread, INFINITE);
+        CloseHandle(watchdogThread);
+        watchdogThread = NULL;
+    }
+    if (watchdogWake) {
+        CloseHandle(watchdogWake);
+        watchdogWake = NULL;
+    }
+    strmap_clear(&watchdogEvents, free);
+    DeleteCriticalSection(&watchdogLock);
+    return 1;
+}
+
+int watchdog_init_module(PyObject *module) {
+    RequestTimeoutError = PyErr_NewExceptionWithDoc(PHIORI_MODULE_NAME ".RequestTimeout",
+        "Raised inside a request handler which overran its time budget.", PyExc_BaseException, NULL);
+    if (!RequestTimeoutError)
+        return 0;
+    Py_INCREF(RequestTimeoutError);
+    return PyModule_AddObject(module, "RequestTimeout", RequestTimeoutError) == 0;
+}
+
+void watchdog_arm(const char *id, size_t id_len) {
+    EnterCriticalSection(&watchdogLock);
+    STRMAP_ENTRY *entry = strmap_put(&watchdogEvents, id ? id : "", id ? id_len : 0);
+    if (entry && !entry->value)
+        entry->value = calloc(1, sizeof(WATCHDOG_EVENT));
+    watchdogCurrent = entry ? entry->value : NULL;
+    watchdogCurrentId = watchdogCurrent ? entry->key : NULL;
+    DWORD budget = watchdogCurrent && watchdogCurrent->has_budget ? watchdogCurrent->budget : watchdogDefaultBudget;
+    QueryPerformanceCounter(&watchdogStart);
+    watchdogGeneration++;
+    watchdogFired = 0;
+    watchdogArmed = budget > 0;
+    watchdogDeadline = GetTickCount64() + budget;
+    LeaveCriticalSection(&watchdogLock);
+    if (budget > 0)
+        SetEvent(watchdogWake);
+}
+
+int watchdog_disarm(void) {
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    LONG64 elapsed_us = (end.QuadPart - watchdogStart.QuadPart) * 1000000 / watchdogFrequency.QuadPart;
+    DWORD elapsed_ms = (DWORD)(elapsed_us / 1000);
+    EnterCriticalSection(&watchdogLock);
+    int fired = watchdogFired;
+    watchdogArmed = 0;
+    watchdogFired = 0;
+    watchdogRequests++;
+    watchdogTotalUs += elapsed_us;
+    if (fired)
+        watchdogOverruns++;
+    if (watchdogCurrent) {
+        watchdogCurrent->count++;
+        watchdogCurrent->total_us += elapsed_us;
+        if (elapsed_ms > watchdogCurrent->max_ms)
+            watchdogCurrent->max_ms = elapsed_ms;
+        if (fired)
+            watchdogCurrent->overruns++;
+    }
+    if (fired) {
+        char message[BUFSIZ];
+        snprintf(message, sizeof(message), "%s overran its time budget (%lu ms).",
+            watchdogCurrentId && *watchdogCurrentId ? watchdogCurrentId : "request", elapsed_ms);
+        log_print(LOG_PHIORI, message);
+    }
+    watchdogCurrent = NULL;
+    watchdogCurrentId = NULL;
+    LeaveCriticalSection(&watchdogLock);
+    return fired;
+}
+
+void watchdog_stats(PyObject *dict) {
+    STRMAP_ENTRY *slowest[WATCHDOG_SLOWEST_COUNT] = {NULL};
+    // copied out under the lock; python may collect, and a finalizer may arm, while objects are built.
+    char *ids[WATCHDOG_SLOWEST_COUNT] = {NULL};
+    size_t id_lens[WATCHDOG_SLOWEST_COUNT];
+    WATCHDOG_EVENT events[WATCHDOG_SLOWEST_COUNT];
+    EnterCriticalSection(&watchdogLock);
+    // keep the slowest offenders sorted by their worst time.
+    STRMAP_FOREACH(watchdogEvents, entry) {
+        WATCHDOG_EVENT *event = entry->value;
+        if (!event || !event->count)
+            continue;
+        for (int i = 0; i < WATCHDOG_SLOWEST_COUNT; i++) {
+            if (!slowest[i] || ((WATCHDOG_EVENT *)slowest[i]->value)->max_ms < event->max_ms) {
+                memmove(&slowest[i + 1], &slowest[i], (WATCHDOG_SLOWEST_COUNT - i - 1) * sizeof(STRMAP_ENTRY *));
+                slowest[i] = entry;
+                break;
+            }
+        }
+    }
+    int count = 0;
+    for (; count < WATCHDOG_SLOWEST_COUNT && slowest[count]; count++) {
+        ids[count] = malloc(slowest[count]->len + 1);
+        if (ids[count])
+            memcpy(ids[count], slowest[count]->key, slowest[count]->len);
+        id_lens[count] = slowest[count]->len;
+        events[count] = *(WATCHDOG_EVENT *)slowest[count]->value;
+    }
+    LONG64 requests = watchdogRequests;
+    LONG64 overruns = watchdogOverruns;
+    LONG64 total_us = watchdogTotalUs;
+    DWORD budget = watchdogDefaultBudget;
+    LeaveCriticalSection(&watchdogLock);
+    PyObject *list = PyList_New(0);
+    for (int i = 0; i < count; i++) {
+        PyObject *item = NULL;
+        if (list && !ids[i])
+            PyErr_NoMemory();
+        else if (list)
+            item = Py_BuildValue("(NkLL)", PyUnicode_FromStringAndSize(ids[i], (Py_ssize_t)id_lens[i]),
+                events[i].max_ms, (long long)events[i].overruns, (long long)events[i].count);
+        if (!item || PyList_Append(list, item) < 0)
+            Py_CLEAR(list);
+        Py_XDECREF(item);
+        free(ids[i]);
+    }
+    PyObject *stats = list ? Py_BuildValue("{s:L,s:L,s:L,s:k,s:O}",
+        "requests", (long long)requests,
+        "overruns", (long long)overruns,
+        "handler_us", (long long)total_us,
+        "budget", budget,
+        "slowest", list) : NULL;
+    Py_XDECREF(list);
+    if (stats) {
+        PyDict_SetItemString(dict, "watchdog", stats);
+        Py_DECREF(stats);
+    }
+}
+
+PyObject *phiori_deadline(PyObject *self, PyObject *args) {
+    PyObject *idObj;
+    unsigned long budget;
+    if (!PyArg_ParseTuple(args, "Ok", &idObj, &budget))
+        return NULL;
+    if (idObj == Py_None) {
+        EnterCriticalSection(&watchdogLock);
+        watchdogDefaultBudget = (DWORD)budget;
+        LeaveCriticalSection(&watchdogLock);
+        Py_RETURN_NONE;
+    }
+    Py_ssize_t id_len;
+    const char *id = PyUnicode_Check(idObj) ? PyUnicode_AsUTF8AndSize(idObj, &id_len) : NULL;
+    if (!id) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "event id must be str or None");
+        return NULL;
+    }
+    EnterCriticalSection(&watchdogLock);
+    STRMAP_ENTRY *entry = strmap_put(&watchdogEvents, id, (size_t)id_len);
+    if (entry && !entry->value)
+        entry->value = calloc(1, sizeof(WATCHDOG_EVENT));
+    if (entry && entry->value) {
+        ((WATCHDOG_EVENT *)entry->value)->has_budget = 1;
+        ((WATCHDOG_EVENT *)entry->value)->budget = (DWORD)budget;
+    }
+    LeaveCriticalSection(&watchdogLock);
+    if (!entry || !entry->value)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
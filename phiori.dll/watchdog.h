@@ -0,0 +1,24 @@
+#ifndef _PHIORI_WATCHDOG
+#define _PHIORI_WATCHDOG 1
+#include <stddef.h>
+#include <Python.h>
+
+#define WATCHDOG_DEFAULT_BUDGET 5000
+// retry interval when python's pending call queue is full.
+#define WATCHDOG_RETRY_INTERVAL 10
+#define WATCHDOG_SLOWEST_COUNT 5
+#define REQUEST_TIMEOUT_MESSAGE "Request has timed out."
+
+extern PyObject *RequestTimeoutError;
+
+int LOAD_Watchdog(void);
+int UNLOAD_Watchdog(void);
+int watchdog_init_module(PyObject *module);
+void watchdog_arm(const char *id, size_t id_len);
+// returns non-zero when the armed request overran its budget.
+int watchdog_disarm(void);
+void watchdog_stats(PyObject *dict);
+
+PyObject *phiori_deadline(PyObject *self, PyObject *args);
+
+#endif